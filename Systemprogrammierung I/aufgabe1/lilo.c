@@ -1,6 +1,9 @@
+// gcc -std=c11 -pedantic -Wall -Werror -D_GNU_SOURCE -pthread -fno-builtin -o lilo lilo.c ../aufgabe5/halde.c
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "../aufgabe5/halde.h"
+
 struct node {
     int value;
     struct node* next;
@@ -8,6 +11,9 @@ struct node {
 
 static struct node* head = NULL;
 
+// All nodes have the same size: they come from a pool instead of malloc
+static struct halde_pool* nodes = NULL;
+
 int insertElement(int value) {
     if (value < 0) {
         return -1;
@@ -23,7 +29,13 @@ int insertElement(int value) {
     }
 
     // Allocate memory for the new node
-    temp = (struct node*) malloc(sizeof(struct node));
+    if (nodes == NULL) {
+        nodes = halde_pool_create(sizeof(struct node));
+        if (nodes == NULL) {
+            return -1;
+        }
+    }
+    temp = (struct node*) halde_pool_alloc(nodes);
     if (temp == NULL) {
         return -1;
     }
@@ -51,7 +63,7 @@ int removeElement(void) {
     int returnValue = head->value;
     struct node* temp = head;
     head = head->next;
-    free(temp);
+    halde_pool_free(nodes, temp);
 
     return returnValue;
 }
@@ -73,8 +85,9 @@ int main (int argc, char* argv[]) {
     while (head != NULL) {
         temp = head;
         head = head->next;
-        free(temp);
+        halde_pool_free(nodes, temp);
     }
+    halde_pool_destroy(nodes);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Runs wsort -t on every generated corpus with both sort engines.
+# Usage: ./bench.sh [lines] [wsort options...]
+
+LINES=${1:-1000000}
+[ $# -gt 0 ] && shift
+
+for kind in uniform zipf prefix sorted reverse; do
+    corpus="bench-$kind-$LINES.txt"
+    if [ ! -f "$corpus" ]; then
+        ./gen "$kind" "$LINES" > "$corpus" || exit 1
+    fi
+
+    for engine in qsort radix; do
+        echo "== $kind ($LINES lines), -s $engine $*"
+        ./wsort -t -s "$engine" "$@" < "$corpus" > /dev/null || exit 1
+    done
+done
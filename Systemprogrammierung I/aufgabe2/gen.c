@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+
+// Deterministic word corpora for benchmarking wsort:
+//   gen uniform|zipf|prefix|sorted|reverse <lines> [seed]
+
+#define MAX_WORD_LENGTH 100
+
+// Distinct words of the zipf corpus
+#define VOCABULARY 100000
+
+// Length of the common prefix of the prefix corpus
+#define PREFIX_LENGTH 70
+
+static void die(const char *s) {
+    perror(s);
+    exit(EXIT_FAILURE);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s uniform|zipf|prefix|sorted|reverse <lines> [seed]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+// xorshift64*, so the corpus does not depend on the rand() of the C library
+static uint64_t state;
+
+static uint64_t next_random(void) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+// Random lowercase word with 1 to max_length characters
+static size_t random_word(char *word, size_t max_length) {
+    size_t length = 1 + next_random() % max_length;
+    for (size_t i = 0; i < length; i++) {
+        word[i] = 'a' + next_random() % 26;
+    }
+    return length;
+}
+
+static void print_word(const char *word, size_t length) {
+    fwrite(word, 1, length, stdout);
+    putchar('\n');
+}
+
+// Words that sort in the order of n: base-26 digits with a fixed width
+static void print_numbered(unsigned long n) {
+    char word[16];
+    word[0] = 'w';
+    for (int i = 13; i >= 1; i--) {
+        word[i] = 'a' + n % 26;
+        n /= 26;
+    }
+    print_word(word, 14);
+}
+
+static void zipf(unsigned long lines) {
+    static char words[VOCABULARY][21];
+    static size_t lengths[VOCABULARY];
+    static double cdf[VOCABULARY];
+
+    // Rank r is drawn with probability proportional to 1/r
+    double sum = 0;
+    for (size_t i = 0; i < VOCABULARY; i++) {
+        lengths[i] = random_word(words[i], 20);
+        sum += 1.0 / (i + 1);
+        cdf[i] = sum;
+    }
+
+    for (unsigned long n = 0; n < lines; n++) {
+        double x = (next_random() >> 11) * (1.0 / 9007199254740992.0) * sum;
+        size_t low = 0;
+        size_t high = VOCABULARY - 1;
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            if (cdf[mid] < x) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        print_word(words[low], lengths[low]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 && argc != 4) {
+        usage(argv[0]);
+    }
+
+    errno = 0;
+    char *endptr;
+    unsigned long lines = strtoul(argv[2], &endptr, 10);
+    if (errno != 0 || endptr == argv[2] || *endptr != '\0') {
+        usage(argv[0]);
+    }
+    state = 88172645463325252ULL;
+    if (argc == 4) {
+        state ^= strtoull(argv[3], NULL, 10) * 0x9E3779B97F4A7C15ULL;
+        if (state == 0) {
+            state = 1;
+        }
+    }
+
+    char word[MAX_WORD_LENGTH];
+    if (strcmp(argv[1], "uniform") == 0) {
+        for (unsigned long n = 0; n < lines; n++) {
+            print_word(word, random_word(word, 20));
+        }
+    } else if (strcmp(argv[1], "zipf") == 0) {
+        zipf(lines);
+    } else if (strcmp(argv[1], "prefix") == 0) {
+        memset(word, 'p', PREFIX_LENGTH);
+        for (unsigned long n = 0; n < lines; n++) {
+            size_t length = random_word(word + PREFIX_LENGTH, MAX_WORD_LENGTH - PREFIX_LENGTH);
+            print_word(word, PREFIX_LENGTH + length);
+        }
+    } else if (strcmp(argv[1], "sorted") == 0) {
+        for (unsigned long n = 0; n < lines; n++) {
+            print_numbered(n);
+        }
+    } else if (strcmp(argv[1], "reverse") == 0) {
+        for (unsigned long n = lines; n > 0; n--) {
+            print_numbered(n - 1);
+        }
+    } else {
+        usage(argv[0]);
+    }
+
+    if (fflush(stdout) == EOF || ferror(stdout)) die("stdout");
+    return 0;
+}
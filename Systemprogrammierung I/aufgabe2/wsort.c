@@ -1,49 +1,880 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <locale.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #define MAX_WORD_LENGTH 100
 
+// Inputs below this many lines are sorted on one thread even with -j
+#define PARALLEL_THRESHOLD 4096
+
+// -j is clamped to this many threads, their handles and runs live on the stack
+#define MAX_THREADS 256
+
+// Buckets below this size are finished with insertion sort by the radix engine
+#define INSERTION_THRESHOLD 32
+
+// Number of spilled runs of the same level that are merged into one run of the next level
+#define MERGE_FANIN 16
+
+// Strings are stored back-to-back in chunks of at most this size
+#define ARENA_CHUNK_SIZE (1024*1024)
+#define MIN_ARENA_CHUNK_SIZE 4096
+
+// Initial capacity of the string array, doubled whenever it is full
+#define INITIAL_CAPACITY 1024
+#define MIN_INITIAL_CAPACITY 16
+
+// Sorted words are packed into buffers of this size (aligned to OUTPUT_ALIGNMENT) before they are written
+#define OUTPUT_BUFFER_SIZE (1024*1024)
+#define OUTPUT_ALIGNMENT 4096
+
+// Initial number of slots of the hash table for -k (power of two)
+#define INITIAL_SLOTS 4096
+
+// What is printed for a run of equal words
+enum output_mode {
+    OUTPUT_ALL,     // every word
+    OUTPUT_UNIQUE,  // -u: the word once
+    OUTPUT_COUNT,   // -c: the number of occurrences and the word, like uniq -c
+};
+
+// Chunk of the string arena
+struct chunk {
+    struct chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+// Growable arena for the strings read from stdin, released as a whole
+struct arena {
+    struct chunk *chunks;  // current chunk first
+    size_t chunk_size;
+    size_t used;           // bytes of all strings (including '\0')
+};
+
+// Length of the key prefix cached in every entry
+#define PREFIX_LENGTH 8
+
+// Sort index entry: the first PREFIX_LENGTH characters are kept next to the pointer, so that most
+// comparisons do not have to touch the string itself
+struct entry {
+    uint64_t prefix;     // first characters, big-endian and zero padded
+    size_t length;
+    const char *string;
+};
+
+// Growable buffer for a collation key (-l), followed by '\0', the word and '\0'
+struct key_buffer {
+    char *data;
+    size_t size;
+};
+
+// One sorted sequence of strings: a slice of the entry array or a spilled run file
+struct run {
+    struct entry *base;  // in-memory run (file == NULL)
+    size_t length;
+    FILE *file;          // spilled run, read back line by line
+    struct entry head;   // current smallest string of the run
+    char line[MAX_WORD_LENGTH + 2];
+    struct key_buffer key;
+};
+
+// Destination of the sorted words: stdout or a run file
+struct output {
+    int fd;
+    char *buffer;                    // buffer being filled
+    size_t used;
+
+    // Writer thread (only for the final output with -j): writes spare while the merge fills buffer
+    bool threaded;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char *spare;
+    size_t full;                     // bytes of spare to write, 0 => writer is idle
+    bool closing;
+
+    enum output_mode mode;
+    size_t pending;                  // occurrences of last that are not printed yet
+    const char *last;
+    size_t last_length;
+    char last_copy[MAX_WORD_LENGTH + 1];
+};
+
+// Called for every accepted word; persistent words stay valid until the end of the program
+typedef void (*word_fn)(const char *word, size_t length, bool persistent, void *ctx);
+
+// Sorted runs that were written to temporary files because of the memory budget
+struct spill {
+    struct run runs[MERGE_FANIN * (sizeof(size_t) * CHAR_BIT)];
+    int levels[MERGE_FANIN * (sizeof(size_t) * CHAR_BIT)];
+    size_t amount;
+};
+
+// Big-endian value of the first PREFIX_LENGTH characters of string, zero padded
+static uint64_t load_prefix(const char *string, size_t length) {
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < PREFIX_LENGTH; i++) {
+        prefix <<= CHAR_BIT;
+        if (i < length) {
+            prefix |= (unsigned char)string[i];
+        }
+    }
+    return prefix;
+}
+
+static struct entry make_entry(const char *string, size_t length) {
+    struct entry e = { load_prefix(string, length), length, string };
+    return e;
+}
+
+// Compares two entries whose first offset characters are equal and whose prefix holds the characters
+// starting at offset; the strings are only read if the prefixes are equal
+static int compare_entries_from(const struct entry *a, const struct entry *b, size_t offset) {
+    if (a->prefix != b->prefix) {
+        return a->prefix < b->prefix ? -1 : 1;
+    }
+    // Equal prefixes of a string that ends within them => both strings are equal
+    size_t skip = offset + PREFIX_LENGTH;
+    if (a->length <= skip || b->length <= skip) {
+        return (a->length > b->length) - (a->length < b->length);
+    }
+
+    size_t min = a->length < b->length ? a->length : b->length;
+    int result = memcmp(a->string + skip, b->string + skip, min - skip);
+    if (result != 0) {
+        return result;
+    }
+    return (a->length > b->length) - (a->length < b->length);
+}
+
+// Compares two entries in strcmp order
+static int compare_entries(const struct entry *a, const struct entry *b) {
+    return compare_entries_from(a, b, 0);
+}
+
 // Function to compare strings for qsort
 static int compare_strings(const void *a, const void *b) {
-    char* const* ca = (char* const*) a;
-    char* const* cb = (char* const*) b;
+    return compare_entries((const struct entry*)a, (const struct entry*)b);
+}
 
-    return strcmp(*ca, *cb);
+static void die(const char *s) {
+    perror(s);
+    exit(EXIT_FAILURE);
 }
 
-// Function to free memory allocated for an array of strings
-static void freeMemory(char **array, int amount){
-    for (int i = 0; i < amount; i++) {
-        free(array[i]);
+// -l: entries are sorted by their strxfrm key for LC_COLLATE instead of the word itself
+static bool collate;
+
+// Word of an entry; with -l the entry's string is the collation key, followed by '\0' and the word
+static const char *entry_word(const struct entry *e, size_t *length) {
+    if (!collate) {
+        *length = e->length;
+        return e->string;
+    }
+    const char *word = e->string + e->length + 1;
+    *length = strlen(word);
+    return word;
+}
+
+// Allocator calls of wsort itself (not of stdio), reported with -t
+static atomic_size_t alloc_calls;
+static atomic_size_t free_calls;
+
+static void *counted_malloc(size_t size) {
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    return malloc(size);
+}
+
+static void *counted_calloc(size_t nmemb, size_t size) {
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    return calloc(nmemb, size);
+}
+
+static void *counted_realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    return realloc(ptr, size);
+}
+
+static void counted_free(void *ptr) {
+    atomic_fetch_add_explicit(&free_calls, 1, memory_order_relaxed);
+    free(ptr);
+}
+
+// Start of the current phase for -t
+struct phase {
+    struct timespec start;
+    size_t alloc_calls;
+    size_t free_calls;
+};
+
+static bool timing;
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void phase_begin(struct phase *phase) {
+    clock_gettime(CLOCK_MONOTONIC, &phase->start);
+    phase->alloc_calls = atomic_load(&alloc_calls);
+    phase->free_calls = atomic_load(&free_calls);
+}
+
+// Prints wall time, throughput, peak RSS so far and allocator calls of the phase to stderr
+static void phase_end(const struct phase *phase, const char *name, size_t lines) {
+    if (!timing) {
+        return;
+    }
+    double seconds = seconds_since(&phase->start);
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1) die("getrusage");
+
+    fprintf(stderr, "%-5s %10.3f s %12.0f lines/s %10ld KB peak RSS %10zu allocs %10zu frees\n",
+            name, seconds, seconds > 0 ? lines / seconds : 0.0, usage.ru_maxrss,
+            atomic_load(&alloc_calls) - phase->alloc_calls, atomic_load(&free_calls) - phase->free_calls);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-j threads] [-m budget[k|M|G]] [-s qsort|radix] [-u | -c | -k count] [-l] [-t]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+// Sort engine: qsort with compare_strings
+static void qsort_strings(struct entry *array, size_t amount) {
+    qsort(array, amount, sizeof(struct entry), compare_strings);
+}
+
+// Character at position depth of the entry, whose prefix holds the characters starting at offset
+static unsigned char entry_char(const struct entry *e, size_t depth, size_t offset) {
+    return (unsigned char)(e->prefix >> (CHAR_BIT * (PREFIX_LENGTH - 1 - (depth - offset))));
+}
+
+// Sorts the entries of a small bucket, which share their first offset characters
+static void insertion_sort(struct entry *array, size_t amount, size_t offset) {
+    for (size_t i = 1; i < amount; i++) {
+        struct entry key = array[i];
+        size_t j = i;
+        while (j > 0 && compare_entries_from(&array[j - 1], &key, offset) > 0) {
+            array[j] = array[j - 1];
+            j--;
+        }
+        array[j] = key;
+    }
+}
+
+// MSD radix sort on the character at position depth; tmp and oracle have room for amount entries.
+// The prefixes are reloaded every PREFIX_LENGTH characters, so the strings themselves are only read
+// once per PREFIX_LENGTH passes. Afterwards the prefixes no longer start at offset 0.
+static void radix_sort(struct entry *array, size_t amount, size_t depth, struct entry *tmp, unsigned char *oracle) {
+    size_t offset = depth - depth % PREFIX_LENGTH;
+    if (depth > 0 && depth == offset) {
+        for (size_t i = 0; i < amount; i++) {
+            array[i].prefix = load_prefix(array[i].string + offset, array[i].length - offset);
+        }
+    }
+
+    if (amount < INSERTION_THRESHOLD) {
+        insertion_sort(array, amount, offset);
+        return;
+    }
+
+    // Cache the characters once, so every entry is touched only once per pass
+    size_t count[UCHAR_MAX + 1] = { 0 };
+    for (size_t i = 0; i < amount; i++) {
+        oracle[i] = entry_char(&array[i], depth, offset);
+        count[oracle[i]]++;
+    }
+
+    // All entries share this character => no need to move them
+    unsigned char first = oracle[0];
+    if (first != 0 && count[first] == amount) {
+        radix_sort(array, amount, depth + 1, tmp, oracle);
+        return;
+    }
+
+    size_t start[UCHAR_MAX + 1];
+    size_t sum = 0;
+    for (int c = 0; c <= UCHAR_MAX; c++) {
+        start[c] = sum;
+        sum += count[c];
+    }
+
+    // Distribute into the buckets (stable) and copy back
+    for (size_t i = 0; i < amount; i++) {
+        tmp[start[oracle[i]]++] = array[i];
+    }
+    memcpy(array, tmp, amount * sizeof(struct entry));
+
+    // Bucket 0 holds the strings that end here and are equal; the others continue with the next character
+    size_t bucket = count[0];
+    for (int c = 1; c <= UCHAR_MAX; c++) {
+        if (count[c] > 1) {
+            radix_sort(array + bucket, count[c], depth + 1, tmp, oracle);
+        }
+        bucket += count[c];
+    }
+}
+
+// Sort engine: MSD radix sort, produces the same order as strcmp
+static void radix_strings(struct entry *array, size_t amount) {
+    if (amount < 2) {
+        return;
+    }
+    struct entry *tmp = counted_malloc(amount * sizeof(struct entry));
+    unsigned char *oracle = counted_malloc(amount);
+    if (tmp == NULL || oracle == NULL) die("malloc");
+
+    radix_sort(array, amount, 0, tmp, oracle);
+
+    counted_free(tmp);
+    counted_free(oracle);
+}
+
+// Selected with -s
+static void (*sort_strings)(struct entry *array, size_t amount) = radix_strings;
+
+static int parse_positive_int_or_die(const char *str) {
+    errno = 0;
+    char *endptr;
+    long x = strtol(str, &endptr, 10);
+    if (errno != 0) die("invalid number");
+    if (str == endptr || *endptr != '\0') {
+        fprintf(stderr, "invalid number\n");
+        exit(EXIT_FAILURE);
+    }
+    if (x <= 0) {
+        fprintf(stderr, "number not positive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (x > INT_MAX) {
+        fprintf(stderr, "number too large\n");
+        exit(EXIT_FAILURE);
+    }
+    return (int)x;
+}
+
+// Parses a byte count with an optional k, M or G suffix
+static size_t parse_size_or_die(const char *str) {
+    errno = 0;
+    char *endptr;
+    unsigned long long x = strtoull(str, &endptr, 10);
+    if (errno != 0) die("invalid size");
+    if (str == endptr || *str == '-') {
+        fprintf(stderr, "invalid size\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int shift = 0;
+    switch (*endptr) {
+    case '\0': break;
+    case 'k': case 'K': shift = 10; endptr++; break;
+    case 'm': case 'M': shift = 20; endptr++; break;
+    case 'g': case 'G': shift = 30; endptr++; break;
+    }
+    if (*endptr != '\0') {
+        fprintf(stderr, "invalid size\n");
+        exit(EXIT_FAILURE);
+    }
+    if (x == 0) {
+        fprintf(stderr, "size not positive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (x > (SIZE_MAX >> shift)) {
+        fprintf(stderr, "size too large\n");
+        exit(EXIT_FAILURE);
+    }
+    return (size_t)x << shift;
+}
+
+// Computes the collation key of word into key->data, followed by '\0', the word and '\0'; returns the key length
+static size_t collate_word(struct key_buffer *key, const char *word, size_t length) {
+    char string[MAX_WORD_LENGTH + 1];
+    memcpy(string, word, length);
+    string[length] = '\0';
+
+    for (;;) {
+        size_t key_length = strxfrm(key->data, string, key->size);
+        if (key_length + length + 2 <= key->size) {
+            memcpy(key->data + key_length + 1, string, length + 1);
+            return key_length;
+        }
+
+        // Too small => grow and transform again
+        key->size = 2 * (key_length + length + 2);
+        key->data = counted_realloc(key->data, key->size);
+        if (key->data == NULL) die("realloc");
+    }
+}
+
+// Thread function: sorts one run with the selected sort engine
+static void *sort_run_thread(void *arg) {
+    struct run *r = (struct run*)arg;
+    sort_strings(r->base, r->length);
+    return NULL;
+}
+
+// Moves the run to its next string, returns false if the run is exhausted
+static bool run_advance(struct run *r) {
+    if (r->file == NULL) {
+        if (r->length == 0) {
+            return false;
+        }
+        // The radix engine leaves shifted prefixes behind => rebuild the entry
+        r->head = make_entry(r->base->string, r->base->length);
+        r->base++;
+        r->length--;
+        return true;
+    }
+
+    if (fgets(r->line, sizeof(r->line), r->file) == NULL) {
+        if (ferror(r->file)) die("fgets");
+        return false;
+    }
+    // Spilled lines were accepted words, so they always fit and end with '\n'
+    size_t length = strlen(r->line) - 1;
+    r->line[length] = '\0';
+    if (collate) {
+        r->head = make_entry(r->key.data, collate_word(&r->key, r->line, length));
+    } else {
+        r->head = make_entry(r->line, length);
+    }
+    return true;
+}
+
+// Closes a spilled run
+static void close_run(struct run *r) {
+    fclose(r->file);
+    counted_free(r->key.data);
+    r->key.data = NULL;
+    r->key.size = 0;
+}
+
+// Restores the min-heap property for heap[i] (heap of run indices keyed by the current head string)
+static void sift_down(size_t *heap, size_t heap_size, size_t i, struct run *runs) {
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+
+        if (left < heap_size && compare_entries(&runs[heap[left]].head, &runs[heap[smallest]].head) < 0) {
+            smallest = left;
+        }
+        if (right < heap_size && compare_entries(&runs[heap[right]].head, &runs[heap[smallest]].head) < 0) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        size_t tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// Writes the whole buffer, continuing after partial writes
+static void write_all(int fd, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            die("write");
+        }
+        buffer += written;
+        length -= written;
+    }
+}
+
+static char *alloc_output_buffer(void) {
+    void *buffer;
+    atomic_fetch_add_explicit(&alloc_calls, 1, memory_order_relaxed);
+    int ret = posix_memalign(&buffer, OUTPUT_ALIGNMENT, OUTPUT_BUFFER_SIZE);
+    if (ret != 0) {
+        errno = ret;
+        die("posix_memalign");
+    }
+    return buffer;
+}
+
+// Thread function: writes every buffer handed over by output_flush
+static void *writer_thread(void *arg) {
+    struct output *out = (struct output*)arg;
+
+    pthread_mutex_lock(&out->lock);
+    for (;;) {
+        while (out->full == 0 && !out->closing) {
+            pthread_cond_wait(&out->changed, &out->lock);
+        }
+        if (out->full == 0) {
+            break;
+        }
+        pthread_mutex_unlock(&out->lock);
+
+        write_all(out->fd, out->spare, out->full);
+
+        pthread_mutex_lock(&out->lock);
+        out->full = 0;
+        pthread_cond_broadcast(&out->changed);
+    }
+    pthread_mutex_unlock(&out->lock);
+    return NULL;
+}
+
+// Prepares the output; with threaded, a writer thread overlaps the writes with the merge
+static void output_open(struct output *out, int fd, bool threaded) {
+    out->fd = fd;
+    out->buffer = alloc_output_buffer();
+    out->used = 0;
+    out->threaded = threaded;
+    if (!threaded) {
+        return;
+    }
+
+    out->spare = alloc_output_buffer();
+    out->full = 0;
+    out->closing = false;
+    pthread_mutex_init(&out->lock, NULL);
+    pthread_cond_init(&out->changed, NULL);
+    int ret = pthread_create(&out->writer, NULL, writer_thread, out);
+    if (ret != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Writes the filled buffer, or hands it over to the writer thread as soon as it is idle
+static void output_flush(struct output *out) {
+    if (out->used == 0) {
+        return;
+    }
+    if (!out->threaded) {
+        write_all(out->fd, out->buffer, out->used);
+        out->used = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&out->lock);
+    while (out->full > 0) {
+        pthread_cond_wait(&out->changed, &out->lock);
+    }
+    char *filled = out->buffer;
+    out->buffer = out->spare;
+    out->spare = filled;
+    out->full = out->used;
+    pthread_cond_broadcast(&out->changed);
+    pthread_mutex_unlock(&out->lock);
+    out->used = 0;
+}
+
+// Prints a word followed by '\n'
+static void print_word(const char *word, size_t length, struct output *out) {
+    if (out->used + length + 1 > OUTPUT_BUFFER_SIZE) {
+        output_flush(out);
+    }
+    memcpy(out->buffer + out->used, word, length);
+    out->buffer[out->used + length] = '\n';
+    out->used += length + 1;
+}
+
+// Prints a word with its number of occurrences in the format of uniq -c
+static void print_counted(const char *word, size_t length, size_t count, struct output *out) {
+    char line[3 * sizeof(size_t) + 2 + MAX_WORD_LENGTH];
+    int n = snprintf(line, sizeof(line), "%7zu %.*s", count, (int)length, word);
+    print_word(line, n, out);
+}
+
+// Prints the pending run of equal words for -u and -c
+static void output_finish(struct output *out) {
+    if (out->pending > 0) {
+        if (out->mode == OUTPUT_COUNT) {
+            print_counted(out->last, out->last_length, out->pending, out);
+        } else {
+            print_word(out->last, out->last_length, out);
+        }
+        out->pending = 0;
+    }
+}
+
+// Prints the next word of the sorted sequence, equal neighbours are combined for -u and -c
+static void emit_word(const struct entry *e, bool persistent, struct output *out) {
+    size_t length;
+    const char *word = entry_word(e, &length);
+    if (out->mode == OUTPUT_ALL) {
+        print_word(word, length, out);
+        return;
+    }
+
+    if (out->pending > 0 && out->last_length == length && memcmp(out->last, word, length) == 0) {
+        out->pending++;
+        return;
+    }
+    output_finish(out);
+
+    // Keep the word until a different one arrives; last_copy lives as long as the output
+    out->last = word;
+    out->last_length = length;
+    if (!persistent) {
+        memcpy(out->last_copy, word, length);
+        out->last = out->last_copy;
+    }
+    out->pending = 1;
+}
+
+// Writes everything that is still buffered and releases the output
+static void output_close(struct output *out) {
+    output_finish(out);
+    output_flush(out);
+    counted_free(out->buffer);
+    if (!out->threaded) {
+        return;
+    }
+
+    pthread_mutex_lock(&out->lock);
+    out->closing = true;
+    pthread_cond_broadcast(&out->changed);
+    pthread_mutex_unlock(&out->lock);
+
+    int ret = pthread_join(out->writer, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "pthread_join: %s\n", strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_destroy(&out->lock);
+    pthread_cond_destroy(&out->changed);
+    counted_free(out->spare);
+}
+
+// k-way merge of the sorted runs, the smallest head is printed first
+static void merge_runs(struct run *runs, size_t amount, struct output *out) {
+    size_t heap[amount];
+    size_t heap_size = 0;
+
+    for (size_t i = 0; i < amount; i++) {
+        if (run_advance(&runs[i])) {
+            heap[heap_size++] = i;
+        }
+    }
+    for (size_t i = heap_size / 2; i-- > 0;) {
+        sift_down(heap, heap_size, i, runs);
+    }
+
+    while (heap_size > 0) {
+        struct run *r = &runs[heap[0]];
+        emit_word(&r->head, r->file == NULL, out);
+
+        // Exhausted run => replace it with the last heap element
+        if (!run_advance(r)) {
+            heap[0] = heap[--heap_size];
+        }
+        sift_down(heap, heap_size, 0, runs);
     }
-    free(array);
 }
 
+// Sorts the array into runs (one per thread) that have to be merged afterwards, returns the number of runs
+static int sort_array(struct entry *array, size_t amount, int numberOfThreads, struct run *runs) {
+    if (numberOfThreads == 1 || amount < PARALLEL_THRESHOLD) {
+        numberOfThreads = 1;
+    }
+    pthread_t threads[numberOfThreads];
+
+    size_t chunk = amount / numberOfThreads;
+    size_t rest = amount % numberOfThreads;
+    struct entry *start = array;
 
-int main() {
+    // Split the array into numberOfThreads runs of (almost) equal length
+    for (int i = 0; i < numberOfThreads; i++) {
+        runs[i].base = start;
+        runs[i].length = chunk + ((size_t)i < rest ? 1 : 0);
+        runs[i].file = NULL;
+        start += runs[i].length;
+    }
 
-    char **array_von_strings = NULL;
-    int size_of_array = 0;
+    // The calling thread sorts the first run itself
+    for (int i = 1; i < numberOfThreads; i++) {
+        int ret = pthread_create(&threads[i], NULL, sort_run_thread, &runs[i]);
+        if (ret != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+            exit(EXIT_FAILURE);
+        }
+    }
+    sort_run_thread(&runs[0]);
+
+    for (int i = 1; i < numberOfThreads; i++) {
+        int ret = pthread_join(threads[i], NULL);
+        if (ret != 0) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(ret));
+            exit(EXIT_FAILURE);
+        }
+    }
+    return numberOfThreads;
+}
+
+// Opens an anonymous temporary file for a spilled run
+static FILE *open_run_file(void) {
+    FILE *file = tmpfile();
+    if (file == NULL) die("tmpfile");
+    return file;
+}
+
+// Rewinds a finished run file so it can be merged (its words were written to the descriptor, not through stdio)
+static void finish_run_file(FILE *file) {
+    rewind(file);
+}
+
+// Merges runs of equal level into one run of the next level, so at most MERGE_FANIN - 1 runs per level stay open
+static void compact_spill(struct spill *spill) {
+    while (spill->amount >= MERGE_FANIN) {
+        size_t first = spill->amount - MERGE_FANIN;
+        int level = spill->levels[first];
+        if (spill->levels[spill->amount - 1] != level) {
+            return;
+        }
+
+        FILE *file = open_run_file();
+        struct output merged = { .mode = OUTPUT_ALL };
+        output_open(&merged, fileno(file), false);
+        merge_runs(&spill->runs[first], MERGE_FANIN, &merged);
+        output_close(&merged);
+        finish_run_file(file);
+
+        for (size_t i = first; i < spill->amount; i++) {
+            close_run(&spill->runs[i]);
+        }
+        spill->runs[first].file = file;
+        spill->levels[first] = level + 1;
+        spill->amount = first + 1;
+    }
+}
+
+// Sorts the strings read so far and writes them to a new run file
+static void spill_array(struct spill *spill, struct entry *array, size_t amount, int numberOfThreads) {
+    struct run runs[numberOfThreads];
+    int amount_of_runs = sort_array(array, amount, numberOfThreads, runs);
+
+    FILE *file = open_run_file();
+    struct output out = { .mode = OUTPUT_ALL };
+    output_open(&out, fileno(file), false);
+    merge_runs(runs, amount_of_runs, &out);
+    output_close(&out);
+    finish_run_file(file);
+
+    spill->runs[spill->amount].file = file;
+    spill->levels[spill->amount] = 0;
+    spill->amount++;
+    compact_spill(spill);
+}
+
+// Copies a string of length len (without '\0') into the arena and returns the copy
+static char *arena_store(struct arena *arena, const char *string, size_t len) {
+    struct chunk *chunk = arena->chunks;
+
+    // Current chunk is full => start a new one
+    if (chunk == NULL || chunk->size - chunk->used < len + 1) {
+        size_t size = arena->chunk_size;
+        if (len + 1 > size) {
+            size = len + 1;
+        }
+        chunk = counted_malloc(sizeof(struct chunk) + size);
+        if (chunk == NULL) die("malloc");
+        chunk->next = arena->chunks;
+        chunk->used = 0;
+        chunk->size = size;
+        arena->chunks = chunk;
+    }
+
+    char *copy = chunk->data + chunk->used;
+    memcpy(copy, string, len + 1);
+    chunk->used += len + 1;
+    arena->used += len + 1;
+    return copy;
+}
+
+// Releases all strings of the arena at once
+static void arena_release(struct arena *arena) {
+    struct chunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        struct chunk *next = chunk->next;
+        counted_free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->used = 0;
+}
+
+// Function to free memory allocated for an array of strings
+static void freeMemory(struct entry *array, struct arena *arena){
+    arena_release(arena);
+    counted_free(array);
+}
+
+// Same limit as the fgets path: a line of more than MAX_WORD_LENGTH characters does not fit into the buffer,
+// and a last line without '\n' is rejected from MAX_WORD_LENGTH - 1 characters on
+static bool word_too_long(size_t length, bool newline) {
+    return length > MAX_WORD_LENGTH || (!newline && length >= MAX_WORD_LENGTH - 1);
+}
+
+// Splits a mapped regular file into lines in place
+static void read_mapped(const char *data, size_t size, word_fn fn, void *ctx) {
+    const char *end = data + size;
+
+    while (data < end) {
+        const char *newline = memchr(data, '\n', end - data);
+        size_t length = (newline != NULL ? newline : end) - data;
+
+        // Skip empty lines
+        if (length > 0) {
+            if (word_too_long(length, newline != NULL)) {
+                fprintf(stderr, "zu langes Wort\n");
+            } else {
+                fn(data, length, true, ctx);
+            }
+        }
+        data += length + (newline != NULL ? 1 : 0);
+    }
+}
+
+// Reads the lines from a stream with fgets
+static void read_stream(FILE *in, word_fn fn, void *ctx) {
     char string[MAX_WORD_LENGTH + 2]; // Temporary storage for input strings (+ \0 \n)
 
-    // Read strings from stdin until EOF is reached
-    while(fgets(string, MAX_WORD_LENGTH + 2, stdin) != NULL){
+    // Read strings until EOF is reached
+    while(fgets(string, MAX_WORD_LENGTH + 2, in) != NULL){
 
         // Skip empty lines
         if (strcmp(string, "\n") == 0) {
             continue;
         }
 
-        // Check for words longer than MAX_WORD_LENGTH - 1 characters and if the last character is not a newline character  
-        if (string[strlen(string) - 1] != '\n' && strlen(string) >= MAX_WORD_LENGTH - 1) {
+        size_t length = strlen(string);
+        bool newline = string[length - 1] == '\n';
+        if (newline) {
+            length--;
+        }
+
+        // Check for words longer than MAX_WORD_LENGTH - 1 characters and if the last character is not a newline character
+        if (word_too_long(length, newline)) {
             int c;
 
-            // loop reads characters from stdin and discards them until either a newline character or EOF is encountered
-            while ((c = fgetc(stdin)) != '\n' && c != EOF); 
+            // loop reads characters and discards them until either a newline character or EOF is encountered
+            while (!newline && (c = fgetc(in)) != '\n' && c != EOF);
 
-            // Error handling for stdin
-            if(ferror(stdin)) {
+            // Error handling for the input stream
+            if(ferror(in)) {
                 perror("fgetc");
                 exit(EXIT_FAILURE);
             }
@@ -54,67 +885,387 @@ int main() {
         }
 
         // Check if last char = "\n" => substitute with "\0"
-        if (string[strlen(string) - 1] == '\n') {
-            string[strlen(string) - 1] = '\0';
+        string[length] = '\0';
+        fn(string, length, false, ctx);
+    }
+
+    // Error handling for fgets
+    if(ferror(in)){
+        perror("fgets");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Maps stdin if it is a regular file, returns NULL otherwise
+static char *map_stdin(size_t *size, size_t *offset) {
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return NULL;
+    }
+
+    // Start at the current position, like fgets would
+    off_t position = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (position == -1 || position >= st.st_size) {
+        return NULL;
+    }
+
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    *size = st.st_size;
+    *offset = position;
+    return data;
+}
+
+// Strings read so far, in memory or spilled to run files
+struct collector {
+    struct entry *array_von_strings;
+    size_t size_of_array;
+    size_t total;           // words including the spilled ones
+    size_t capacity;
+    size_t initial_capacity;
+    struct arena arena;
+    struct key_buffer key;  // -l: key of the current word
+    size_t budget;
+    int numberOfThreads;
+    struct spill spill;
+};
+
+// Slot of the hash table for -k
+struct counter {
+    size_t count;   // 0 => empty slot
+    uint64_t hash;
+    const char *word;
+    size_t length;
+};
+
+// Occurrences of every distinct word for -k
+struct counter_table {
+    struct counter *slots;
+    size_t capacity;        // power of two
+    size_t used;
+    size_t words;           // all words counted
+    struct arena arena;     // copies of words that are not persistent
+};
+
+// FNV-1a
+static uint64_t hash_word(const char *word, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)word[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Doubles the number of slots (linear probing)
+static void grow_counter_table(struct counter_table *t) {
+    size_t capacity = t->capacity == 0 ? INITIAL_SLOTS : 2 * t->capacity;
+    struct counter *slots = counted_calloc(capacity, sizeof(struct counter));
+    if (slots == NULL) die("calloc");
+
+    for (size_t i = 0; i < t->capacity; i++) {
+        if (t->slots[i].count == 0) {
+            continue;
+        }
+        size_t j = t->slots[i].hash & (capacity - 1);
+        while (slots[j].count != 0) {
+            j = (j + 1) & (capacity - 1);
+        }
+        slots[j] = t->slots[i];
+    }
+    counted_free(t->slots);
+    t->slots = slots;
+    t->capacity = capacity;
+}
+
+// word_fn counting the word in the hash table
+static void count_word(const char *word, size_t length, bool persistent, void *ctx) {
+    struct counter_table *t = (struct counter_table*)ctx;
+    if (2 * (t->used + 1) > t->capacity) {
+        grow_counter_table(t);
+    }
+
+    t->words++;
+    uint64_t hash = hash_word(word, length);
+    size_t i = hash & (t->capacity - 1);
+    while (t->slots[i].count != 0) {
+        struct counter *c = &t->slots[i];
+        if (c->hash == hash && c->length == length && memcmp(c->word, word, length) == 0) {
+            c->count++;
+            return;
         }
+        i = (i + 1) & (t->capacity - 1);
+    }
+
+    // New word => keep a copy unless it lives in the mapped input
+    if (!persistent) {
+        word = arena_store(&t->arena, word, length);
+    }
+    t->slots[i] = (struct counter) { 1, hash, word, length };
+    t->used++;
+}
+
+// Returns true if a ranks before b: more occurrences first, equal counts in strcmp order
+static bool counter_before(const struct counter *a, const struct counter *b) {
+    if (a->count != b->count) {
+        return a->count > b->count;
+    }
+    struct entry ea = make_entry(a->word, a->length);
+    struct entry eb = make_entry(b->word, b->length);
+    return compare_entries(&ea, &eb) < 0;
+}
 
-        // Allocate memory for the new string
-        array_von_strings = realloc(array_von_strings, (size_of_array + 1) * sizeof(char*));
+static int compare_counters(const void *a, const void *b) {
+    const struct counter *ca = *(const struct counter* const*)a;
+    const struct counter *cb = *(const struct counter* const*)b;
+    return counter_before(ca, cb) ? -1 : counter_before(cb, ca) ? 1 : 0;
+}
+
+// Restores the heap property for heap[i]; the root is the counter that ranks last
+static void sift_down_counters(struct counter **heap, size_t heap_size, size_t i) {
+    for (;;) {
+        size_t last = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+
+        if (left < heap_size && counter_before(heap[last], heap[left])) {
+            last = left;
+        }
+        if (right < heap_size && counter_before(heap[last], heap[right])) {
+            last = right;
+        }
+        if (last == i) {
+            return;
+        }
+        struct counter *tmp = heap[i];
+        heap[i] = heap[last];
+        heap[last] = tmp;
+        i = last;
+    }
+}
+
+// Prints the k most frequent words, selected with a heap of size k in one pass over the table
+static void print_top(struct counter_table *t, size_t k, struct output *out) {
+    if (k > t->used) {
+        k = t->used;
+    }
+    struct counter **heap = counted_malloc((k + 1) * sizeof(struct counter*));
+    if (heap == NULL) die("malloc");
+    size_t heap_size = 0;
+
+    for (size_t i = 0; i < t->capacity && k > 0; i++) {
+        struct counter *c = &t->slots[i];
+        if (c->count == 0) {
+            continue;
+        }
+        if (heap_size < k) {
+            // Sift up
+            size_t j = heap_size++;
+            while (j > 0 && counter_before(heap[(j - 1) / 2], c)) {
+                heap[j] = heap[(j - 1) / 2];
+                j = (j - 1) / 2;
+            }
+            heap[j] = c;
+        } else if (counter_before(c, heap[0])) {
+            heap[0] = c;
+            sift_down_counters(heap, heap_size, 0);
+        }
+    }
+
+    qsort(heap, heap_size, sizeof(struct counter*), compare_counters);
+    for (size_t i = 0; i < heap_size; i++) {
+        print_counted(heap[i]->word, heap[i]->length, heap[i]->count, out);
+    }
+    counted_free(heap);
+}
+
+// word_fn adding the word to the sort index
+static void collect_word(const char *word, size_t length, bool persistent, void *ctx) {
+    struct collector *c = (struct collector*)ctx;
+
+    // -l: store the collation key followed by the word, the entry only covers the key
+    size_t key_length = length;
+    if (collate) {
+        key_length = collate_word(&c->key, word, length);
+        word = c->key.data;
+        length = key_length + 1 + length;
+        persistent = false;
+    }
+
+    // Memory budget reached => sort what we have and spill it to disk (the array is kept for the next batch)
+    size_t next_capacity = c->size_of_array == c->capacity ? 2 * c->capacity : c->capacity;
+    size_t copied = persistent ? 0 : length + 1;
+    if (c->size_of_array > 0 && c->arena.used + copied + next_capacity * sizeof(struct entry) > c->budget) {
+        spill_array(&c->spill, c->array_von_strings, c->size_of_array, c->numberOfThreads);
+        arena_release(&c->arena);
+        c->size_of_array = 0;
+    }
+
+    // Array is full => double its capacity
+    if (c->size_of_array == c->capacity) {
+        c->capacity = c->capacity == 0 ? c->initial_capacity : 2 * c->capacity;
+        c->array_von_strings = counted_realloc(c->array_von_strings, c->capacity * sizeof(struct entry));
 
         // Error handling for realloc
-        if (array_von_strings == NULL) {
+        if (c->array_von_strings == NULL) {
             perror("realloc");
             exit(EXIT_FAILURE);
         }
+    }
 
-        // Allocate memory for the string itself
-        array_von_strings[size_of_array] = malloc((strlen(string) + 1) * sizeof(char));
+    // Copy the string into the arena unless it lives in the mapped input
+    if (!persistent) {
+        word = arena_store(&c->arena, word, length);
+    }
+    c->array_von_strings[c->size_of_array] = make_entry(word, key_length);
+    c->size_of_array++;
+    c->total++;
+}
 
-        // Error handling for malloc
-        if (array_von_strings[size_of_array] == NULL) {
-            perror("malloc");
-            exit(EXIT_FAILURE);
-        }
 
-        // Copy the string into the array
-        strcpy(array_von_strings[size_of_array], string);
-        size_of_array++;
+int main(int argc, char *argv[]) {
+
+    static struct collector collector = { .budget = SIZE_MAX, .numberOfThreads = 1 };
+    static struct output out;
+    size_t top = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:m:s:uck:tl")) != -1) {
+        switch (opt) {
+        case 'j':
+            collector.numberOfThreads = parse_positive_int_or_die(optarg);
+            if (collector.numberOfThreads > MAX_THREADS) {
+                collector.numberOfThreads = MAX_THREADS;
+            }
+            break;
+        case 'm':
+            collector.budget = parse_size_or_die(optarg);
+            break;
+        case 's':
+            if (strcmp(optarg, "qsort") == 0) {
+                sort_strings = qsort_strings;
+            } else if (strcmp(optarg, "radix") == 0) {
+                sort_strings = radix_strings;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'u':
+            out.mode = OUTPUT_UNIQUE;
+            break;
+        case 'c':
+            out.mode = OUTPUT_COUNT;
+            break;
+        case 'k':
+            top = parse_positive_int_or_die(optarg);
+            break;
+        case 't':
+            timing = true;
+            break;
+        case 'l':
+            collate = true;
+            if (setlocale(LC_COLLATE, "") == NULL) {
+                fprintf(stderr, "setlocale: LC_COLLATE not supported, using the C locale\n");
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
     }
+    int numberOfThreads = collector.numberOfThreads;
 
-    // Error handling for fgets
-    if(ferror(stdin)){
-        perror("fgets");
-        exit(EXIT_FAILURE);
+    // Keep the chunks and the initial array small compared to the budget, so that a small budget still
+    // holds more than a few words per spilled run
+    collector.arena.chunk_size = ARENA_CHUNK_SIZE;
+    if (collector.budget / 4 < ARENA_CHUNK_SIZE) {
+        collector.arena.chunk_size = collector.budget / 4 < MIN_ARENA_CHUNK_SIZE ? MIN_ARENA_CHUNK_SIZE : collector.budget / 4;
     }
+    collector.initial_capacity = INITIAL_CAPACITY;
+    if (collector.budget / 4 / sizeof(struct entry) < INITIAL_CAPACITY) {
+        size_t capacity = collector.budget / 4 / sizeof(struct entry);
+        collector.initial_capacity = capacity < MIN_INITIAL_CAPACITY ? MIN_INITIAL_CAPACITY : capacity;
+    }
+
+    // Regular files are sorted in place (zero-copy), everything else is read with fgets
+    struct phase phase;
+    phase_begin(&phase);
+    size_t mapped_size = 0;
+    size_t offset = 0;
+    char *mapped = map_stdin(&mapped_size, &offset);
 
-    // Sort the array of strings
-    qsort(array_von_strings, size_of_array, sizeof(char*), compare_strings);
+    // Top-k: count the words in a hash table instead of sorting them
+    if (top > 0) {
+        struct counter_table table = { .arena = { .chunk_size = ARENA_CHUNK_SIZE } };
+        if (mapped != NULL) {
+            read_mapped(mapped + offset, mapped_size - offset, count_word, &table);
+        } else {
+            read_stream(stdin, count_word, &table);
+        }
+        phase_end(&phase, "read", table.words);
+
+        phase_begin(&phase);
+        output_open(&out, STDOUT_FILENO, false);
+        print_top(&table, top, &out);
+        output_close(&out);
+        phase_end(&phase, "write", table.used);
 
-    // Print the sorted strings to stdout
-    for (int i = 0; i < size_of_array; i++) {
-        fputs(array_von_strings[i], stdout);
-        fputs("\n", stdout);
+        counted_free(table.slots);
+        arena_release(&table.arena);
+        if (mapped != NULL && munmap(mapped, mapped_size) == -1) {
+            die("munmap");
+        }
+        return 0;
     }
 
-    fflush(stdout);
-    // Error handling for fflush
-    if (ferror(stdout)){
-        perror("fflush");
-        exit(EXIT_FAILURE);
+    if (mapped != NULL) {
+        read_mapped(mapped + offset, mapped_size - offset, collect_word, &collector);
+    } else {
+        read_stream(stdin, collect_word, &collector);
+    }
+    // With -m this includes sorting and writing the spilled runs
+    phase_end(&phase, "read", collector.total);
+
+    // Sort the remaining strings (on numberOfThreads threads) and merge them with the spilled runs while printing
+    phase_begin(&phase);
+    struct spill *spill = &collector.spill;
+    // the number of spilled runs is not bounded, so this one goes to the heap
+    struct run *runs = counted_malloc((spill->amount + numberOfThreads) * sizeof(struct run));
+    if (runs == NULL) die("malloc");
+    memcpy(runs, spill->runs, spill->amount * sizeof(struct run));
+    int amount_of_runs = sort_array(collector.array_von_strings, collector.size_of_array, numberOfThreads, &runs[spill->amount]);
+    phase_end(&phase, "sort", collector.size_of_array);
+
+    // Includes the final k-way merge
+    phase_begin(&phase);
+    output_open(&out, STDOUT_FILENO, numberOfThreads > 1);
+    merge_runs(runs, spill->amount + amount_of_runs, &out);
+    output_close(&out);
+    phase_end(&phase, "write", collector.total);
+
+    for (size_t i = 0; i < spill->amount; i++) {
+        close_run(&runs[i]);
     }
+    counted_free(runs);
 
-    // Error handling for stdout and stderr
-    if(ferror(stdout) || ferror(stderr)){
-        perror("stdout or stderr");
+    // Error handling for stderr
+    if(ferror(stderr)){
+        perror("stderr");
         exit(EXIT_FAILURE);
     }
 
     // Free allocated memory
-    freeMemory(array_von_strings, size_of_array);
+    freeMemory(collector.array_von_strings, &collector.arena);
+    counted_free(collector.key.data);
+    if (mapped != NULL && munmap(mapped, mapped_size) == -1) {
+        die("munmap");
+    }
 
     // stdout, stdin, stderr werden üblicherweise nicht geschlossen
-    // fclose(stdin); 
+    // fclose(stdin);
     // fclose(stdout);
     return 0;
 }
-
@@ -1,14 +1,38 @@
+/* pipe2, epoll and syscall are Linux extensions */
+#define _GNU_SOURCE
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
-#include "run.h"
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include "queue.h"
+#include "sem.h"
 #include <pthread.h>
 
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
 #define QEVT_RUNNING  (INT_MIN)
 #define QEVT_SHUTDOWN (INT_MIN + 1)
+#define QEVT_OUTPUT   (INT_MIN + 2)
+
+/* Events handled per epoll_wait */
+#define MAX_EVENTS 64
+
+/* Output buffer of a running command in streaming mode */
+#define STREAM_BUFFER 4096
+/* Chunks on their way to the output thread at most */
+#define STREAM_CHUNKS 64
+
+extern char **environ;
 
 static void die(const char *s) {
     perror(s);
@@ -35,10 +59,215 @@ static int parse_positive_int_or_die(char *str) {
     return (int)x;
 }
 
+/*
+ * One machfile entry. Lines are commands, blank lines become barriers that
+ * wait for everything before them:
+ *
+ *     cmd                      runs after the previous barrier
+ *     @name: cmd               the same, but others can refer to it
+ *     @name after: a b: cmd    runs as soon as a and b are done
+ */
+typedef struct {
+    char *name;     /* NULL for unnamed commands and barriers */
+    char *cmd;      /* NULL for barriers, handed to the output thread once run */
+    char *after;    /* names after "after:", resolved once the whole file is read */
+    int line;
+    int *succ;
+    int nsucc;
+    int capsucc;
+    int missing;    /* predecessors that have not finished yet */
+    int priority;   /* commands on the longest path from here to the end */
+} Node;
+
+static Node *nodes;
+static int num_nodes = 0;
+static int cap_nodes = 0;
+/* Nodes that have not finished yet */
+static int remaining;
+
+/* Max-heap of the commands whose predecessors are all done */
+static int *ready;
+static int num_ready = 0;
+
+/*
+ * A running command. The child is done once its pipe reached EOF and it was
+ * reaped through its pidfd, whichever comes first.
+ */
 typedef struct {
-    char *cmd;
-    char *out;
-} Command;
+    int node;       /* -1 if the slot is free */
+    pid_t pid;
+    int pidfd;      /* -1 once reaped */
+    int pipe;       /* read end of stdout and stderr, -1 after EOF */
+    int status;
+    char *out;      /* the fixed STREAM_BUFFER in streaming mode */
+    size_t len;
+    size_t cap;
+} Child;
+
+/* One slot per command that may run at the same time */
+static Child *children;
+static int epfd;
+
+/* -s: forward output line by line while the commands run */
+static int streaming = 0;
+/* Free places for chunks, so output is forwarded no faster than printed */
+static SEM *chunks_free;
+/* Set once a command could not be started at all */
+static int failed = 0;
+
+static int add_node(char *name, char *cmd, char *after) {
+    for (int i = 0; name && i < num_nodes; i++) {
+        if (nodes[i].name && strcmp(nodes[i].name, name) == 0) {
+            fprintf(stderr, "duplicate job `%s`\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (num_nodes == cap_nodes) {
+        cap_nodes = cap_nodes ? 2 * cap_nodes : 64;
+        nodes = realloc(nodes, cap_nodes * sizeof(Node));
+        if (!nodes) die("realloc");
+    }
+    nodes[num_nodes] = (Node){name, cmd, after, 0, NULL, 0, 0, 0, 0};
+    return num_nodes++;
+}
+
+static void add_edge(int from, int to) {
+    Node *node = &nodes[from];
+    if (node->nsucc == node->capsucc) {
+        node->capsucc = node->capsucc ? 2 * node->capsucc : 4;
+        node->succ = realloc(node->succ, node->capsucc * sizeof(int));
+        if (!node->succ) die("realloc");
+    }
+    node->succ[node->nsucc++] = to;
+    nodes[to].missing++;
+}
+
+static void syntax_error(const char *file, int lineno) {
+    fprintf(stderr, "%s:%d: invalid job line\n", file, lineno);
+    exit(EXIT_FAILURE);
+}
+
+/* Splits "@name: cmd" and "@name after: a b: cmd" */
+static void parse_named(char *line, char **name, char **after, char **cmd, const char *file, int lineno) {
+    char *p = line + 1;
+    size_t len = strcspn(p, ": \t\n");
+    if (len == 0) syntax_error(file, lineno);
+    *name = strndup(p, len);
+    if (!*name) die("strndup");
+    p += len;
+    p += strspn(p, " \t");
+
+    *after = NULL;
+    if (strncmp(p, "after:", 6) == 0) {
+        p += 6;
+        len = strcspn(p, ":\n");
+        if (p[len] != ':') syntax_error(file, lineno);
+        *after = strndup(p, len);
+        if (!*after) die("strndup");
+        p += len;
+    }
+    if (*p != ':') syntax_error(file, lineno);
+    p++;
+    p += strspn(p, " \t");
+
+    *cmd = strdup(p);
+    if (!*cmd) die("strdup");
+}
+
+/* Turns the after: lists into edges */
+static void resolve_after(void) {
+    for (int v = 0; v < num_nodes; v++) {
+        if (!nodes[v].after) continue;
+        char *save;
+        for (char *dep = strtok_r(nodes[v].after, " \t", &save); dep; dep = strtok_r(NULL, " \t", &save)) {
+            int u = 0;
+            while (u < num_nodes && !(nodes[u].name && strcmp(nodes[u].name, dep) == 0)) u++;
+            if (u == num_nodes) {
+                fprintf(stderr, "unknown job `%s`\n", dep);
+                exit(EXIT_FAILURE);
+            }
+            add_edge(u, v);
+        }
+    }
+}
+
+/* Sorts the graph topologically and gives every node the length of the longest path it starts */
+static void prioritize(void) {
+    int *order = malloc(num_nodes * sizeof(int));
+    int *missing = malloc(num_nodes * sizeof(int));
+    if (!order || !missing) die("malloc");
+
+    int n = 0;
+    for (int v = 0; v < num_nodes; v++) {
+        missing[v] = nodes[v].missing;
+        if (missing[v] == 0) order[n++] = v;
+    }
+    for (int i = 0; i < n; i++) {
+        Node *node = &nodes[order[i]];
+        for (int j = 0; j < node->nsucc; j++) {
+            if (--missing[node->succ[j]] == 0) order[n++] = node->succ[j];
+        }
+    }
+    if (n != num_nodes) {
+        fprintf(stderr, "dependency cycle\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = num_nodes - 1; i >= 0; i--) {
+        Node *node = &nodes[order[i]];
+        int longest = 0;
+        for (int j = 0; j < node->nsucc; j++) {
+            if (nodes[node->succ[j]].priority > longest) longest = nodes[node->succ[j]].priority;
+        }
+        node->priority = longest + (node->cmd != NULL);
+    }
+
+    free(order);
+    free(missing);
+}
+
+/* Critical path first, ties in file order */
+static int runs_before(int a, int b) {
+    if (nodes[a].priority != nodes[b].priority) return nodes[a].priority > nodes[b].priority;
+    return a < b;
+}
+
+static void ready_push(int v) {
+    int i = num_ready++;
+    while (i > 0 && runs_before(v, ready[(i - 1) / 2])) {
+        ready[i] = ready[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    ready[i] = v;
+}
+
+static int ready_pop(void) {
+    int top = ready[0];
+    int last = ready[--num_ready];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= num_ready) break;
+        if (child + 1 < num_ready && runs_before(ready[child + 1], ready[child])) child++;
+        if (!runs_before(ready[child], last)) break;
+        ready[i] = ready[child];
+        i = child;
+    }
+    ready[i] = last;
+    return top;
+}
+
+/* Marks a node as done; successors without other missing predecessors become ready */
+static void finish(int v) {
+    remaining--;
+    for (int j = 0; j < nodes[v].nsucc; j++) {
+        int s = nodes[v].succ[j];
+        if (--nodes[s].missing == 0) {
+            if (nodes[s].cmd == NULL) finish(s);
+            else ready_push(s);
+        }
+    }
+}
 
 static void *output_thread_func(void *arg) {
     (void)arg;
@@ -60,6 +289,25 @@ static void *output_thread_func(void *arg) {
             free(out);
             break;
         }
+        if (flags == QEVT_OUTPUT) {
+            /* cmd is the prefix, out holds whole lines apart from a cut overlong one */
+            for (char *line = out; *line != '\0';) {
+                size_t len = strcspn(line, "\n");
+                printf("%s %.*s\n", cmd, (int)len, line);
+                line += len;
+                if (*line == '\n') line++;
+            }
+            free(cmd);
+            free(out);
+            V(chunks_free);
+            continue;
+        }
+        if (streaming) {
+            printf("Completed `%s` (exit %d).\n", cmd ? cmd : "", flags);
+            free(cmd);
+            free(out);
+            continue;
+        }
 
         printf("Completed `%s`: \"%s\".\n", cmd ? cmd : "", out ? out : "");
         free(cmd);
@@ -68,38 +316,167 @@ static void *output_thread_func(void *arg) {
     return NULL;
 }
 
-static void *executeCommands(void *arg) {
-    Command *command = (Command*)arg;
+/* epoll data: slot number, lowest bit set for the pidfd */
+static void watch(int fd, int slot, int is_pidfd) {
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = (uint64_t)slot << 1 | is_pidfd};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) != 0) die("epoll_ctl");
+}
+
+/* Starts `sh -c cmd` with stdout and stderr on a non-blocking pipe; -1 with errno set on failure */
+static int spawn(Child *child, int slot, const char *cmd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return -1;
+    if (fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0) die("fcntl");
+    /* keeps a descriptor free for the pidfd, so a started child can always be watched */
+    int reserved = fcntl(fds[0], F_DUPFD_CLOEXEC, 0);
+    if (reserved < 0) {
+        int err = errno;
+        close(fds[0]);
+        close(fds[1]);
+        errno = err;
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) die("posix_spawn_file_actions_init");
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+
+    char *argv[] = {"sh", "-c", (char *)cmd, NULL};
+    int err = posix_spawn(&child->pid, "/bin/sh", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    close(reserved);
+    if (err != 0) {
+        close(fds[0]);
+        errno = err;
+        return -1;
+    }
+
+    child->pidfd = syscall(SYS_pidfd_open, child->pid, 0);
+    if (child->pidfd < 0) die("pidfd_open");
+    child->pipe = fds[0];
+    child->len = 0;
+    if (!streaming) {
+        child->cap = 0;
+        child->out = NULL;
+    }
+    watch(child->pipe, slot, 0);
+    watch(child->pidfd, slot, 1);
+    return 0;
+}
+
+/* Hands the first n bytes of the buffer to the output thread, prefixed with the job name or line */
+static void forward(Child *child, size_t n) {
+    Node *node = &nodes[child->node];
+    char *prefix;
+    int rc = node->name ? asprintf(&prefix, "[%s]", node->name) : asprintf(&prefix, "[%d]", node->line);
+    char *chunk = malloc(n + 1);
+    if (rc < 0 || !chunk) die("malloc");
+    memcpy(chunk, child->out, n);
+    chunk[n] = '\0';
+
+    P(chunks_free);
+    if (queue_put(prefix, chunk, QEVT_OUTPUT) != 0) {
+        fprintf(stderr, "Failed queue_put (output)\n");
+        exit(EXIT_FAILURE);
+    }
+    child->len -= n;
+    memmove(child->out, child->out + n, child->len);
+}
+
+/* Appends whatever the pipe holds to the output. In streaming mode complete lines are
+ * forwarded right away, and a line filling the whole buffer is cut. */
+static void drain(Child *child) {
+    for (;;) {
+        if (streaming && child->cap - child->len < 2) {
+            forward(child, child->len);
+        } else if (child->cap - child->len < 2) {
+            child->cap = child->cap ? 2 * child->cap : 4096;
+            child->out = realloc(child->out, child->cap);
+            if (!child->out) die("realloc");
+        }
+        ssize_t n = read(child->pipe, child->out + child->len, child->cap - child->len - 1);
+        if (n > 0) {
+            child->len += n;
+            char *end = streaming ? memrchr(child->out, '\n', child->len) : NULL;
+            if (end) forward(child, end - child->out + 1);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n < 0) perror("read");
+        if (streaming && child->len > 0) forward(child, child->len);
+        /* closing the fd removes it from the epoll set */
+        close(child->pipe);
+        child->pipe = -1;
+        break;
+    }
+    child->out[child->len] = '\0';
+}
+
+static void reap(Child *child) {
+    int status;
+    if (waitpid(child->pid, &status, 0) < 0) die("waitpid");
+    child->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    close(child->pidfd);
+    child->pidfd = -1;
+}
 
-    char *start_msg = strdup(command->cmd);
+/* Starts a command in a free slot and announces it; returns the slot, -1 with errno set if
+ * it could not start. The caller makes sure a slot is free. */
+static int start(int v) {
+    int slot = 0;
+    while (children[slot].node >= 0) slot++;
+    if (spawn(&children[slot], slot, nodes[v].cmd) != 0) return -1;
+    children[slot].node = v;
+
+    char *start_msg = strdup(nodes[v].cmd);
     if (!start_msg) die("strdup");
     if (queue_put(start_msg, NULL, QEVT_RUNNING) != 0) {
         fprintf(stderr, "Failed queue_put (running)\n");
         exit(EXIT_FAILURE);
     }
+    return slot;
+}
 
-    int returnValue = run_cmd(command->cmd, &(command->out));
+/* Out of descriptors or processes: this passes once running children are done */
+static int exhausted(int err) {
+    return err == EMFILE || err == ENFILE || err == EAGAIN;
+}
 
-    if (queue_put(command->cmd, command->out, returnValue) != 0) {
+/* Reports a command that could not be started as completed with status -1 */
+static void fail(int v, int err) {
+    const char *cmd = nodes[v].cmd;
+    fprintf(stderr, "cannot start `%.*s`: %s\n", (int)strcspn(cmd, "\n"), cmd, strerror(err));
+    if (queue_put(nodes[v].cmd, NULL, -1) != 0) {
         fprintf(stderr, "Failed queue_put (completed)\n");
         exit(EXIT_FAILURE);
     }
+    failed = 1;
+    finish(v);
+}
 
-    free(command);
-    return NULL;
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-s] <num_threads> <file>\n", name);
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <num_threads> <file>\n", argv[0]);
-        exit(EXIT_FAILURE);
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        if (opt != 's') usage(argv[0]);
+        streaming = 1;
     }
+    if (argc - optind != 2) usage(argv[0]);
 
-    int numberOfThreads = parse_positive_int_or_die(argv[1]);
+    int numberOfThreads = parse_positive_int_or_die(argv[optind]);
+    const char *path = argv[optind + 1];
 
     if (queue_init() != 0) die("queue_init failed");
 
-    FILE *file = fopen(argv[2], "r");
+    FILE *file = fopen(path, "r");
     if (file == NULL) die("Failed to open file");
 
     pthread_t output_thread;
@@ -109,61 +486,131 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    pthread_t threads[numberOfThreads];
-    int used[numberOfThreads];
-    for (int i = 0; i < numberOfThreads; i++) used[i] = 0;
+    /* All children are supervised by this thread through one epoll set */
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) die("epoll_create1");
+    children = malloc(numberOfThreads * sizeof(Child));
+    if (!children) die("malloc");
+    for (int i = 0; i < numberOfThreads; i++) children[i].node = -1;
+    if (streaming) {
+        chunks_free = semCreate(STREAM_CHUNKS);
+        if (!chunks_free) die("semCreate");
+        for (int i = 0; i < numberOfThreads; i++) {
+            children[i].out = malloc(STREAM_BUFFER);
+            if (!children[i].out) die("malloc");
+            children[i].cap = STREAM_BUFFER;
+        }
+    }
 
+    /* The last barrier and the first node after it */
+    int barrier = -1;
+    int group = 0;
+    int lineno = 0;
     char line[4097];
 
     while (fgets(line, sizeof(line), file) != NULL) {
+        lineno++;
         if (line[0] == '\n' || line[0] == '\0') {
-            for (int i = 0; i < numberOfThreads; i++) {
-                if (used[i]) {
-                    pthread_join(threads[i], NULL);
-                    used[i] = 0;
-                }
-            }
+            int b = add_node(NULL, NULL, NULL);
+            if (barrier >= 0) add_edge(barrier, b);
+            for (int i = group; i < b; i++) add_edge(i, b);
+            barrier = b;
+            group = b + 1;
             continue;
         }
 
-        int slot = -1;
-        while (slot == -1) {
-            for (int i = 0; i < numberOfThreads; i++) {
-                if (!used[i]) { slot = i; break; }
-            }
-            if (slot == -1) {
-                for (int i = 0; i < numberOfThreads; i++) {
-                    if (used[i]) {
-                        pthread_join(threads[i], NULL);
-                        used[i] = 0;
-                        break;
-                    }
-                }
-            }
+        char *name = NULL;
+        char *after = NULL;
+        char *cmd;
+        if (line[0] == '@') {
+            parse_named(line, &name, &after, &cmd, path, lineno);
+        } else {
+            cmd = strdup(line);
+            if (!cmd) die("strdup");
         }
+        int v = add_node(name, cmd, after);
+        nodes[v].line = lineno;
+        /* explicit dependencies replace the barrier */
+        if (!after && barrier >= 0) add_edge(barrier, v);
+    }
 
-        Command *command = malloc(sizeof(Command));
-        if (!command) die("malloc");
-        command->cmd = strdup(line);
-        if (!command->cmd) die("strdup");
-        command->out = NULL;
+    if (ferror(file)) die("fgets");
 
-        ret = pthread_create(&threads[slot], NULL, executeCommands, command);
-        if (ret != 0) {
-            fprintf(stderr, "pthread_create(worker): %s\n", strerror(ret));
-            exit(EXIT_FAILURE);
-        }
-        used[slot] = 1;
+    resolve_after();
+    prioritize();
+
+    ready = malloc((num_nodes + 1) * sizeof(int));
+    int *roots = malloc((num_nodes + 1) * sizeof(int));
+    if (!ready || !roots) die("malloc");
+
+    /* roots are collected first, finish() readies nodes of its own */
+    int num_roots = 0;
+    for (int v = 0; v < num_nodes; v++) {
+        if (nodes[v].missing == 0) roots[num_roots++] = v;
+    }
+    remaining = num_nodes;
+    for (int i = 0; i < num_roots; i++) {
+        if (nodes[roots[i]].cmd == NULL) finish(roots[i]);
+        else ready_push(roots[i]);
     }
+    free(roots);
 
-    if (ferror(file)) die("fgets");
+    /* At most numberOfThreads commands run at a time */
+    int running = 0;
+    while (remaining > 0) {
+        while (running < numberOfThreads && num_ready > 0) {
+            int v = ready_pop();
+            if (start(v) >= 0) {
+                running++;
+            } else if (exhausted(errno) && running > 0) {
+                /* try again when the next child is done */
+                ready_push(v);
+                break;
+            } else {
+                fail(v, errno);
+            }
+        }
+        if (remaining == 0) break;
 
-    for (int i = 0; i < numberOfThreads; i++) {
-        if (used[i]) {
-            pthread_join(threads[i], NULL);
-            used[i] = 0;
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("epoll_wait");
         }
+        for (int i = 0; i < n; i++) {
+            Child *child = &children[events[i].data.u64 >> 1];
+            if (events[i].data.u64 & 1) {
+                if (child->pidfd >= 0) reap(child);
+            } else if (child->pipe >= 0) {
+                drain(child);
+            }
+            if (child->node < 0 || child->pidfd >= 0 || child->pipe >= 0) continue;
+
+            if (queue_put(nodes[child->node].cmd, streaming ? NULL : child->out, child->status) != 0) {
+                fprintf(stderr, "Failed queue_put (completed)\n");
+                exit(EXIT_FAILURE);
+            }
+            int v = child->node;
+            child->node = -1;
+            running--;
+            finish(v);
+        }
+    }
+
+    for (int v = 0; v < num_nodes; v++) {
+        free(nodes[v].name);
+        free(nodes[v].after);
+        free(nodes[v].succ);
+    }
+    free(nodes);
+    free(ready);
+    if (streaming) {
+        for (int i = 0; i < numberOfThreads; i++) free(children[i].out);
+        semDestroy(chunks_free);
     }
+    free(children);
+    close(epfd);
 
     if (queue_put(NULL, NULL, QEVT_SHUTDOWN) != 0) {
         fprintf(stderr, "Failed queue_put (shutdown)\n");
@@ -178,5 +625,5 @@ int main(int argc, char *argv[]) {
     if (fclose(file) != 0) perror("fclose");
 
     queue_deinit();
-    exit(EXIT_SUCCESS);
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -1,84 +1,122 @@
+/* syscall is a Linux extension */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "queue.h"
-#include "sem.h"
 
-typedef struct QueueNode {
+/* Capacity of the ring, a power of two */
+#define QUEUE_SLOTS 1024
+
+/*
+ * Bounded multi-producer single-consumer ring. Each slot carries a sequence
+ * number: a producer may fill slot i % QUEUE_SLOTS once its sequence is i, the
+ * consumer may take it once it is i + 1. Producers claim positions with a CAS on
+ * tail, the consumer alone advances head. Nobody takes a lock, and threads
+ * only sleep on a futex when the ring is empty or full.
+ */
+typedef struct {
+    atomic_uint seq;
     char *cmd;
     char *out;
     int flags;
-    struct QueueNode *next;
-} QueueNode;
+} Slot;
+
+static Slot ring[QUEUE_SLOTS];
+static atomic_uint tail;
+static unsigned head;
 
-static QueueNode *head = NULL;
-static QueueNode *tail = NULL;
+/* Futex words: bumped on every put and every get */
+static atomic_uint put_count;
+static atomic_uint get_count;
+/* Sleepers on them, so the fast path skips the wake-up syscall */
+static atomic_int consumer_waiting;
+static atomic_int producers_waiting;
 
-static SEM *mutex;
-static SEM *items;
+static void futex_wait(atomic_uint *word, unsigned seen) {
+    syscall(SYS_futex, (unsigned *)word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *word, int n) {
+    syscall(SYS_futex, (unsigned *)word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
 
 int queue_init(void) {
-    items = semCreate(0);
-    mutex = semCreate(1);
-    if (mutex == NULL || items == NULL) {
-        if (mutex != NULL) semDestroy(mutex);
-        if (items != NULL) semDestroy(items);
-        mutex = NULL;
-        items = NULL;
-        return -1;
+    for (unsigned i = 0; i < QUEUE_SLOTS; i++) {
+        atomic_init(&ring[i].seq, i);
     }
-    head = NULL;
-    tail = NULL;
+    atomic_init(&tail, 0);
+    head = 0;
+    atomic_init(&put_count, 0);
+    atomic_init(&get_count, 0);
+    atomic_init(&consumer_waiting, 0);
+    atomic_init(&producers_waiting, 0);
     return 0;
 }
 
 void queue_deinit(void) {
-    if (mutex) { semDestroy(mutex); mutex = NULL; }
-    if (items) { semDestroy(items); items = NULL; }
-    head = NULL;
-    tail = NULL;
 }
 
 int queue_put(char *cmd, char *out, int flags) {
-    QueueNode *new_node = (QueueNode*)malloc(sizeof(QueueNode));
-    if (new_node == NULL) return -1;
-
-    new_node->cmd = cmd;
-    new_node->out = out;
-    new_node->flags = flags;
-    new_node->next = NULL;
-
-    P(mutex);
-    if (tail != NULL) {
-        tail->next = new_node;
-    } else {
-        head = new_node;
+    unsigned pos = atomic_load_explicit(&tail, memory_order_relaxed);
+    Slot *slot;
+    for (;;) {
+        slot = &ring[pos % QUEUE_SLOTS];
+        unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int diff = (int)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* full: sleep until the consumer frees a slot, unless it just did */
+            unsigned seen = atomic_load(&get_count);
+            atomic_fetch_add(&producers_waiting, 1);
+            if (atomic_load(&slot->seq) == seq) futex_wait(&get_count, seen);
+            atomic_fetch_sub(&producers_waiting, 1);
+            pos = atomic_load_explicit(&tail, memory_order_relaxed);
+        } else {
+            /* another producer claimed pos */
+            pos = atomic_load_explicit(&tail, memory_order_relaxed);
+        }
     }
-    tail = new_node;
-    V(mutex);
-    V(items);
 
+    slot->cmd = cmd;
+    slot->out = out;
+    slot->flags = flags;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    atomic_fetch_add(&put_count, 1);
+    /* only the first put after the consumer went to sleep pays for the wake-up */
+    if (atomic_exchange(&consumer_waiting, 0)) futex_wake(&put_count, 1);
     return 0;
 }
 
 int queue_get(char **cmd, char **out, int *flags) {
-    P(items);
-    P(mutex);
-
-    if (head == NULL) {
-        V(mutex);
-        return -1;
+    Slot *slot = &ring[head % QUEUE_SLOTS];
+    while (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1) {
+        /* empty: sleep until a producer publishes, unless one just did */
+        unsigned seen = atomic_load(&put_count);
+        atomic_store(&consumer_waiting, 1);
+        if (atomic_load(&slot->seq) != head + 1) futex_wait(&put_count, seen);
+        atomic_store(&consumer_waiting, 0);
     }
 
-    QueueNode *node = head;
-    head = node->next;
-    if (head == NULL) tail = NULL;
-
-    *cmd = node->cmd;
-    *out = node->out;
-    *flags = node->flags;
+    *cmd = slot->cmd;
+    *out = slot->out;
+    *flags = slot->flags;
+    atomic_store_explicit(&slot->seq, head + QUEUE_SLOTS, memory_order_release);
+    head++;
 
-    free(node);
-    V(mutex);
+    /*
+     * A producer only sleeps on a full ring, so at least QUEUE_SLOTS more gets follow
+     * and one of them hits a half-ring boundary: waking there refills in batches
+     * instead of paying a syscall per get.
+     */
+    atomic_fetch_add(&get_count, 1);
+    if (head % (QUEUE_SLOTS / 2) == 0 && atomic_load(&producers_waiting) > 0) futex_wake(&get_count, INT_MAX);
     return 0;
 }
@@ -5,6 +5,9 @@
  * This module implements a synchronized blocking FIFO (first-in-first-out)
  * queue for the mach project to store commands to run, their output and
  * optional flags.
+ *
+ * The queue is a bounded lock-free ring for any number of producers and a
+ * single consumer: only one thread may call queue_get().
  */
 
 #ifndef QUEUE_H
@@ -42,6 +45,8 @@ void queue_deinit(void);
  * The caller controls the lifespan of all pointers. The queue will not
  * duplicate or copy any arguments. It only stores the provided pointers.
  *
+ * If the queue is full, the function waits until an element is removed.
+ *
  * @param cmd command to run
  * @param out output of the command
  * @param flags additional flags (optional)
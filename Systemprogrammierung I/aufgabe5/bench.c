@@ -0,0 +1,427 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "halde.h"
+
+// halde-ref.o has no statistics: the benchmark then reports "-" for them
+#pragma weak halde_stats
+
+/// Live objects of the synthetic traces. halde-ref.o never merges free chunks, so its
+/// 1 MiB heap fragments and it fails part of any trace with mixed sizes: the throughput
+/// is therefore taken over the successful operations only. The fixed-size traces are
+/// the ones both allocators get through.
+#define SLOTS 512
+
+/// Object size of the fixed-size traces.
+#define FIXED_SIZE 64
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+/// Default number of operations per synthetic trace.
+#define DEFAULT_OPS 200000
+
+/// One allocation event of a trace. slot names the object, so traces do not depend on addresses.
+struct op {
+    char type;   // 'm' malloc, 'c' calloc, 'r' realloc, 'f' free
+    uint32_t slot;
+    size_t size;
+};
+
+/// Trace to replay.
+struct trace {
+    const char *name;
+    struct op *ops;
+    size_t length;
+    size_t capacity;
+    size_t slots;
+};
+
+/// Result of one replay.
+struct result {
+    double seconds;
+    size_t failed;
+    long resident;   // KiB resident at the peak of the trace
+};
+
+/// xorshift64* generator, so every run replays the same synthetic traces.
+static uint64_t state = 0x9e3779b97f4a7c15u;
+
+static uint64_t next_random(void) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1du;
+}
+
+/// Random size between 16 and max bytes, small sizes being much more frequent.
+static size_t random_size(size_t max) {
+    size_t limit = 16 << (next_random() % 8);
+    if (limit > max) {
+        limit = max;
+    }
+    return 1 + next_random() % limit;
+}
+
+/// Memory of the benchmark itself comes straight from mmap, so it never shows up in the allocator under test.
+static void *map(size_t size) {
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    return memory;
+}
+
+static void trace_init(struct trace *trace, const char *name, size_t capacity) {
+    trace->name = name;
+    trace->ops = map(capacity * sizeof(struct op));
+    trace->length = 0;
+    trace->capacity = capacity;
+    trace->slots = SLOTS;
+}
+
+static void trace_add(struct trace *trace, char type, size_t slot, size_t size) {
+    if (trace->length == trace->capacity) {
+        size_t capacity = trace->capacity * 2;
+        struct op *ops = map(capacity * sizeof(struct op));
+        memcpy(ops, trace->ops, trace->length * sizeof(struct op));
+        munmap(trace->ops, trace->capacity * sizeof(struct op));
+        trace->ops = ops;
+        trace->capacity = capacity;
+    }
+    trace->ops[trace->length++] = (struct op){type, slot, size};
+}
+
+/// Stack discipline: fill all slots, free them in reverse order, repeat.
+/// Objects are fixed bytes large, or of random size if fixed is 0.
+static void make_lifo(struct trace *trace, const char *name, size_t ops, size_t fixed) {
+    trace_init(trace, name, ops + SLOTS);
+    while (trace->length < ops) {
+        size_t depth = 1 + next_random() % SLOTS;
+        for (size_t i = 0; i < depth; i++) {
+            trace_add(trace, 'm', i, fixed ? fixed : random_size(2048));
+        }
+        for (size_t i = depth; i-- > 0;) {
+            trace_add(trace, 'f', i, 0);
+        }
+    }
+}
+
+/// Queue discipline: the oldest object is freed whenever a new one is allocated.
+/// Objects are fixed bytes large, or of random size if fixed is 0.
+static void make_fifo(struct trace *trace, const char *name, size_t ops, size_t fixed) {
+    trace_init(trace, name, ops + SLOTS);
+    for (size_t i = 0; trace->length < ops; i++) {
+        if (i >= SLOTS) {
+            trace_add(trace, 'f', i % SLOTS, 0);
+        }
+        trace_add(trace, 'm', i % SLOTS, fixed ? fixed : random_size(2048));
+    }
+    for (size_t i = 0; i < SLOTS; i++) {
+        trace_add(trace, 'f', i, 0);
+    }
+}
+
+/// Random lifetimes: a random slot is freed or allocated, a few allocations are zeroed.
+static void make_random(struct trace *trace, size_t ops) {
+    trace_init(trace, "random", ops + SLOTS);
+    char used[SLOTS] = {0};
+    while (trace->length < ops) {
+        size_t slot = next_random() % SLOTS;
+        if (used[slot]) {
+            trace_add(trace, 'f', slot, 0);
+        } else {
+            trace_add(trace, next_random() % 8 == 0 ? 'c' : 'm', slot, random_size(1024));
+        }
+        used[slot] = !used[slot];
+    }
+    for (size_t slot = 0; slot < SLOTS; slot++) {
+        if (used[slot]) {
+            trace_add(trace, 'f', slot, 0);
+        }
+    }
+}
+
+/// Growing arrays: a few buffers grow in small steps, interleaved, then start over.
+static void make_realloc(struct trace *trace, size_t ops) {
+    enum { BUFFERS = 32, STEP = 64, MAX = 16384 };
+    trace_init(trace, "realloc", ops + BUFFERS);
+    size_t size[BUFFERS] = {0};
+    while (trace->length < ops) {
+        size_t slot = next_random() % BUFFERS;
+        if (size[slot] >= MAX) {
+            trace_add(trace, 'f', slot, 0);
+            size[slot] = 0;
+        } else {
+            size[slot] += STEP;
+            trace_add(trace, 'r', slot, size[slot]);
+        }
+    }
+    for (size_t slot = 0; slot < BUFFERS; slot++) {
+        if (size[slot] > 0) {
+            trace_add(trace, 'f', slot, 0);
+        }
+    }
+}
+
+/// Reads a HALDE_TRACE file. Addresses are turned into slots, events on addresses that
+/// were allocated before the ring buffer started are dropped.
+static void read_trace(struct trace *trace, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    // open addressing: address -> slot + 1, a freed slot keeps its key as a tombstone
+    size_t capacity = 1 << 20;
+    uintptr_t *keys = map(capacity * sizeof(uintptr_t));
+    uint32_t *values = map(capacity * sizeof(uint32_t));
+    uint32_t *free_slots = map(capacity * sizeof(uint32_t));
+    size_t free_count = 0;
+    size_t used = 0;
+
+    trace_init(trace, path, 4096);
+    trace->slots = 0;
+
+    char type;
+    uintptr_t ptr;
+    size_t size;
+    uintptr_t result;
+    while (fscanf(file, " %c %" SCNxPTR " %zu %" SCNxPTR, &type, &ptr, &size, &result) == 4) {
+        // look up the slot of the object an event refers to
+        size_t slot = SIZE_MAX;
+        size_t h = 0;
+        if (ptr != 0 && type != 'a') {
+            for (h = (ptr >> 4) & (capacity - 1); keys[h] != 0; h = (h + 1) & (capacity - 1)) {
+                if (keys[h] == ptr && values[h] != 0) {
+                    slot = values[h] - 1;
+                    break;
+                }
+            }
+            if (slot == SIZE_MAX) {
+                continue;
+            }
+            values[h] = 0;
+        }
+
+        if (type == 'f') {
+            if (slot == SIZE_MAX) {
+                // free(NULL)
+                continue;
+            }
+            trace_add(trace, 'f', slot, 0);
+            free_slots[free_count++] = slot;
+            continue;
+        }
+        if (result == 0) {
+            // the call failed (or realloc freed): the object is gone
+            if (slot != SIZE_MAX) {
+                trace_add(trace, 'f', slot, 0);
+                free_slots[free_count++] = slot;
+            }
+            continue;
+        }
+
+        // aligned requests are replayed as malloc, halde-ref.o has no memalign
+        if (slot == SIZE_MAX) {
+            slot = free_count > 0 ? free_slots[--free_count] : trace->slots++;
+            trace_add(trace, type == 'c' ? 'c' : 'm', slot, size);
+        } else {
+            trace_add(trace, 'r', slot, size);
+        }
+
+        if (++used > capacity / 2) {
+            fprintf(stderr, "%s: too many events\n", path);
+            exit(EXIT_FAILURE);
+        }
+        for (h = (result >> 4) & (capacity - 1); keys[h] != 0 && values[h] != 0; h = (h + 1) & (capacity - 1)) {
+        }
+        keys[h] = result;
+        values[h] = slot + 1;
+    }
+    fclose(file);
+
+    munmap(keys, capacity * sizeof(uintptr_t));
+    munmap(values, capacity * sizeof(uint32_t));
+    munmap(free_slots, capacity * sizeof(uint32_t));
+}
+
+/// Resident memory of the process in KiB. Plain read(2): stdio would allocate from the
+/// allocator under test, which may be out of memory. The same goes for peak_kib().
+static long resident_kib(void) {
+    char buffer[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd == -1) {
+        perror("/proc/self/statm");
+        exit(EXIT_FAILURE);
+    }
+    ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    long size, resident;
+    buffer[n > 0 ? n : 0] = '\0';
+    if (sscanf(buffer, "%ld %ld", &size, &resident) != 2) {
+        fprintf(stderr, "/proc/self/statm: unexpected format\n");
+        exit(EXIT_FAILURE);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/// Resets the peak resident size of the process to the current one.
+static void reset_peak(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd == -1 || write(fd, "5", 1) != 1) {
+        perror("/proc/self/clear_refs");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+/// Peak resident size in KiB since the last reset_peak().
+static long peak_kib(void) {
+    char buffer[4096];
+    int fd = open("/proc/self/status", O_RDONLY);
+    if (fd == -1) {
+        perror("/proc/self/status");
+        exit(EXIT_FAILURE);
+    }
+    ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    buffer[n > 0 ? n : 0] = '\0';
+    char *line = strstr(buffer, "VmHWM:");
+    long peak;
+    if (line == NULL || sscanf(line, "VmHWM: %ld", &peak) != 1) {
+        fprintf(stderr, "/proc/self/status: no VmHWM\n");
+        exit(EXIT_FAILURE);
+    }
+    return peak;
+}
+
+/// Replays a trace and frees whatever it leaves behind.
+static struct result replay(const struct trace *trace, struct halde_stats *stats) {
+    char **objects = map(trace->slots * sizeof(char *) + 1);
+    struct result result = {0, 0, 0};
+
+    struct timespec start, end;
+    reset_peak();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < trace->length; i++) {
+        const struct op *op = &trace->ops[i];
+        char **object = &objects[op->slot];
+        switch (op->type) {
+        case 'm':
+            *object = malloc(op->size);
+            break;
+        case 'c':
+            *object = calloc(1, op->size);
+            break;
+        case 'r': {
+            char *grown = realloc(*object, op->size);
+            if (grown != NULL) {
+                *object = grown;
+            } else {
+                result.failed++;
+            }
+            continue;
+        }
+        case 'f':
+            free(*object);
+            *object = NULL;
+            continue;
+        }
+
+        if (*object == NULL) {
+            result.failed++;
+        } else {
+            // touch the memory like a real program would
+            (*object)[0] = 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    // fragmentation is measured at the end of the trace, before the leftovers are freed
+    if (halde_stats) {
+        halde_stats(stats);
+    }
+    result.resident = peak_kib();
+    for (size_t slot = 0; slot < trace->slots; slot++) {
+        free(objects[slot]);
+    }
+    munmap(objects, trace->slots * sizeof(char *) + 1);
+    return result;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: bench [-n ops] [halde-trace...]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    size_t ops = DEFAULT_OPS;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n') {
+            usage();
+        }
+        char *end;
+        errno = 0;
+        ops = strtoul(optarg, &end, 10);
+        if (errno != 0 || *end != '\0' || ops == 0) {
+            usage();
+        }
+    }
+
+    // synthetic traces, or the recorded ones given on the command line
+    size_t count = argc > optind ? (size_t)(argc - optind) : 6;
+    struct trace *traces = map(count * sizeof(struct trace));
+    if (argc > optind) {
+        for (size_t i = 0; i < count; i++) {
+            read_trace(&traces[i], argv[optind + i]);
+        }
+    } else {
+        make_lifo(&traces[0], "lifo", ops, 0);
+        make_fifo(&traces[1], "fifo", ops, 0);
+        make_random(&traces[2], ops);
+        make_realloc(&traces[3], ops);
+        make_lifo(&traces[4], "lifo-" STR(FIXED_SIZE), ops, FIXED_SIZE);
+        make_fifo(&traces[5], "fifo-" STR(FIXED_SIZE), ops, FIXED_SIZE);
+    }
+
+    // the traces are in memory before the baseline is taken, so the rss peak above it is the allocator's footprint
+    long baseline = resident_kib();
+    printf("%-10s %9s %12s %7s %12s %6s %12s\n", "trace", "ops", "ok ops/s", "failed", "peak mapped", "frag", "rss peak");
+    for (size_t i = 0; i < count; i++) {
+        struct halde_stats stats;
+        struct result result = replay(&traces[i], &stats);
+
+        // a failed call is cheap and does no work, it does not count as throughput
+        size_t ok = traces[i].length - result.failed;
+        printf("%-10s %9zu %12.0f %7zu", traces[i].name, traces[i].length, ok / result.seconds, result.failed);
+        if (halde_stats) {
+            // 0% when all free memory is one chunk, close to 100% when it is scattered
+            size_t frag = stats.free_bytes ? 100 - stats.largest_free * 100 / stats.free_bytes : 0;
+            printf(" %12zu %5zu%%", stats.peak_mapped, frag);
+        } else {
+            printf(" %12s %6s", "-", "-");
+        }
+        printf(" %8ld KiB\n", result.resident - baseline);
+    }
+
+    // the peak resident size covers all traces
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("max rss: %ld KiB\n", usage.ru_maxrss);
+
+    exit(EXIT_SUCCESS);
+}
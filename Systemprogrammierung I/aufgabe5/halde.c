@@ -1,5 +1,9 @@
 #include "halde.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,42 +14,749 @@
 /// Magic value for occupied memory chunks.
 #define MAGIC ((void*)0xbaadf00d)
 
-/// Size of the heap (in bytes).
+/// Size of the first arena (in bytes).
 #define SIZE (1024*1024*1)
 
+/// Each further arena is this many times larger than the previous one.
+#ifndef GROWTH_FACTOR
+#define GROWTH_FACTOR 2
+#endif
+
+/// Arenas do not grow beyond this size (in bytes).
+#ifndef MAX_ARENA_SIZE
+#define MAX_ARENA_SIZE (SIZE * 64)
+#endif
+
+/// Requests of at least this size get a mapping of their own (in bytes).
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (256*1024)
+#endif
+
+/// Alignment of all sizes and returned pointers.
+#define ALIGNMENT 16
+
+/// Smallest payload of a free chunk that is split off.
+#define MIN_PAYLOAD ALIGNMENT
+
+/// The free lists form a two-level index (TLSF): the first level splits sizes into powers
+/// of two, the second level splits each power of two into SL_COUNT lists of equal width.
+#define SL_LOG2 4
+#define SL_COUNT (1 << SL_LOG2)
+
+/// Chunks below SMALL_BLOCK all share first-level list 0, in steps of ALIGNMENT.
+#define FL_SHIFT (SL_LOG2 + 4)
+#define SMALL_BLOCK ((size_t)1 << FL_SHIFT)
+
+/// Number of first-level lists, enough for any size_t.
+#define FL_COUNT (sizeof(size_t) * 8 - FL_SHIFT + 1)
+
+/// Number of free lists.
+#define NUM_LISTS (FL_COUNT * SL_COUNT)
+
+/// Lists served from the per-thread caches: all chunks up to 1024 bytes (list_index(1024) + 1).
+#define CACHED_CLASSES (3 * SL_COUNT + 1)
+
+/// Number of chunks moved between a thread cache and the free lists at once.
+#define BATCH 16
+
+/// A thread cache holding more chunks of one class than this is drained by one batch.
+#define CACHE_LIMIT (2 * BATCH)
+
+/// Number of allocation events kept by the HALDE_TRACE ring buffer.
+#define TRACE_EVENTS (1 << 16)
+
+/// Number of counter shards; threads are spread over them round-robin.
+#define SHARDS 16
+
+/// Chunk is free (flag in the low bits of mblock.size).
+#define FREE ((size_t)1)
+
+/// Physically preceding chunk is free, its size is in the footer right before this header.
+#define PREV_FREE ((size_t)2)
+
+/// Chunk has a mapping of its own and is returned to the system by free().
+#define MMAPPED ((size_t)4)
+
+/// All flag bits of mblock.size.
+#define FLAGS (FREE | PREV_FREE | MMAPPED)
+
 /// Memory-chunk structure.
+/// Free chunks keep a pointer to their list predecessor in the first word of memory and
+/// their size in the last word of memory (footer), so neighbours can be merged in O(1).
 struct mblock {
     struct mblock* next;
     size_t size;
     char memory[];
 };
 
-/// Heap-memory area.
-static char* memory;
+/// Heap-memory area: a mapping holding chunks, ended by an occupied fence header.
+struct arena {
+    struct arena* next;
+    size_t size;
+    char memory[];
+};
 
-/// Pointer to the first element of the free-memory list.
-static struct mblock* head;
+/// List of all arenas, newest first.
+static struct arena* arenas;
 
-/// Helper function to visualise the current state of the free-memory list.
-void printList(void) {
-    struct mblock* lauf = head;
+/// Size of the next arena to be mapped.
+static size_t arena_size = SIZE;
 
-    // Empty list
-    if (head == NULL) {
-        char empty[] = "(empty)\n";
-        write(STDERR_FILENO, empty, sizeof(empty));
-        // return;
-        abort();
+/// Protects the arenas and the free lists.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Chunks a thread keeps for itself, one list per small class, linked through next.
+/// From the arena's point of view they are occupied, but next is not MAGIC, so a
+/// double free still aborts.
+struct cache {
+    struct mblock* head;
+    size_t count;
+};
+
+/// Per-thread caches; cache[i] holds chunks of at least class_size(i) bytes.
+static _Thread_local struct cache cache[CACHED_CLASSES];
+
+/// Key whose destructor hands the cache of an exiting thread back to the free lists.
+static pthread_key_t cache_key;
+
+/// Creates cache_key exactly once.
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/// Whether the calling thread has set cache_key, so its caches are drained at exit.
+static _Thread_local int cache_registered;
+
+/// Counters behind halde_stats(), updated with relaxed atomics. Every thread counts in
+/// its own shard, each shard on cache lines of its own, so the fast path does not
+/// contend; halde_stats() adds the shards up. in_use of a single shard may wrap when
+/// threads free each other's memory, the sum is right.
+struct counters {
+    _Alignas(64) atomic_size_t malloc_calls;
+    atomic_size_t free_calls;
+    atomic_size_t realloc_calls;
+    atomic_size_t calloc_calls;
+    atomic_size_t memalign_calls;
+    atomic_size_t in_use;
+    atomic_size_t cache_hits;
+    atomic_size_t search[HALDE_SEARCH_BUCKETS];
+    atomic_size_t splits;
+    atomic_size_t coalesces;
+    atomic_size_t realloc_in_place;
+    atomic_size_t realloc_copied;
+};
+
+static struct counters shards[SHARDS];
+
+/// Shard of the calling thread, assigned on its first count.
+static _Thread_local struct counters* shard;
+
+/// Number of shards handed out so far.
+static atomic_size_t next_shard;
+
+/// Mapped memory and the peaks only change when the heap grows or shrinks, on the slow path.
+static atomic_size_t mapped;
+static atomic_size_t peak_mapped;
+static atomic_size_t peak_in_use;
+
+/// One entry of the allocation trace, see halde.h for the file format.
+struct event {
+    char op;
+    uintptr_t ptr;
+    size_t size;
+    uintptr_t result;
+};
+
+/// Ring buffer of the last TRACE_EVENTS events, NULL unless HALDE_TRACE is set.
+static struct event* trace;
+
+/// Number of events recorded so far; trace[n % TRACE_EVENTS] is the next slot.
+static atomic_size_t trace_next;
+
+/// File the trace is written to at exit.
+static int trace_fd = -1;
+
+/// Copy of stderr for HALDE_STATS, programs may close stderr before the exit handlers run.
+static int stats_fd = -1;
+
+/// Free lists. lists[i] holds chunks of at least class_size(i) bytes and less than
+/// class_size(i + 1) bytes.
+static struct mblock* lists[NUM_LISTS];
+
+/// Bit fl is set if any list of first level fl is non-empty.
+static uint64_t fl_bitmap;
+
+/// Bit sl of sl_bitmap[fl] is set if lists[fl * SL_COUNT + sl] is non-empty.
+static uint32_t sl_bitmap[FL_COUNT];
+
+/// Counter shard of the calling thread.
+static struct counters* counters(void) {
+    if (shard == NULL) {
+        shard = &shards[atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % SHARDS];
+    }
+    return shard;
+}
+
+/// Sums a counter over all shards.
+#define SUM(field, total) do { \
+        total = 0; \
+        for (size_t s_ = 0; s_ < SHARDS; s_++) { \
+            total += atomic_load_explicit(&shards[s_].field, memory_order_relaxed); \
+        } \
+    } while (0)
+
+/// Raises peak to value if it is higher.
+static void raise_peak(atomic_size_t* peak, size_t value) {
+    size_t old = atomic_load_explicit(peak, memory_order_relaxed);
+    while (value > old && !atomic_compare_exchange_weak_explicit(peak, &old, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/// Raises the peak of the memory in use to the current amount plus size bytes about to be
+/// handed out. Only the paths that leave the thread's cache sample it, not every malloc.
+static void sample_peak(size_t size) {
+    size_t in_use;
+    SUM(in_use, in_use);
+    raise_peak(&peak_in_use, in_use + size);
+}
+
+/// Records that the heap grows by length bytes to serve a request of size bytes.
+static void count_growth(size_t length, size_t size) {
+    size_t now = atomic_fetch_add_explicit(&mapped, length, memory_order_relaxed) + length;
+    raise_peak(&peak_mapped, now);
+    sample_peak(size);
+}
+
+/// Adds n to a counter.
+static void count(atomic_size_t* counter, size_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+/// Subtracts n from a counter.
+static void uncount(atomic_size_t* counter, size_t n) {
+    atomic_fetch_sub_explicit(counter, n, memory_order_relaxed);
+}
+
+/// Files the length of a free-list search in the histogram.
+static void count_search(size_t steps) {
+    size_t bucket = 0;
+    while ((steps >>= 1) != 0 && bucket < HALDE_SEARCH_BUCKETS - 1) {
+        bucket++;
+    }
+    count(&counters()->search[bucket], 1);
+}
+
+/// Records an allocation event if tracing is enabled.
+static void trace_event(char op, void* ptr, size_t size, void* result) {
+    if (trace != NULL) {
+        size_t slot = atomic_fetch_add_explicit(&trace_next, 1, memory_order_relaxed) % TRACE_EVENTS;
+        trace[slot] = (struct event){op, (uintptr_t)ptr, size, (uintptr_t)result};
     }
+}
 
-    // Print each element in the list
+/// Rounds size up to the alignment.
+static size_t align(size_t size) {
+    return (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+/// Position of the highest set bit of size (size > 0).
+static unsigned fls(size_t size) {
+    return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(size);
+}
+
+/// Index of the free list a chunk of the given size belongs to.
+static size_t list_index(size_t size) {
+    if (size < SMALL_BLOCK) {
+        return size / ALIGNMENT;
+    }
+    unsigned f = fls(size);
+    size_t fl = f - FL_SHIFT + 1;
+    size_t sl = (size >> (f - SL_LOG2)) - SL_COUNT;
+    return fl * SL_COUNT + sl;
+}
+
+/// Smallest chunk size of free list i.
+static size_t class_size(size_t i) {
+    size_t fl = i / SL_COUNT;
+    size_t sl = i % SL_COUNT;
+    if (fl == 0) {
+        return sl * ALIGNMENT;
+    }
+    return (SL_COUNT + sl) << (fl + FL_SHIFT - 1 - SL_LOG2);
+}
+
+/// Payload size handed out for a request: requests are rounded up to the start of a list,
+/// so any chunk of that list fits.
+static size_t request_size(size_t size) {
+    size = align(size);
+    if (size >= SMALL_BLOCK) {
+        size_t step = (size_t)1 << (fls(size) - SL_LOG2);
+        size = (size + step - 1) & ~(step - 1);
+    }
+    return size;
+}
+
+/// Rounds size up to whole pages.
+static size_t page_align(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+/// First page of the mapping of a chunk with MMAPPED set.
+static char* mapping_start(const struct mblock* block) {
+    return (char*)((uintptr_t)block & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1));
+}
+
+/// Payload size of a chunk without the flag bits.
+static size_t block_size(const struct mblock* block) {
+    return block->size & ~FLAGS;
+}
+
+/// Chunk physically following block (the fence for the last chunk).
+static struct mblock* next_block(struct mblock* block) {
+    return (struct mblock*)(block->memory + block_size(block));
+}
+
+/// Chunk physically preceding block, only valid if PREV_FREE is set.
+static struct mblock* prev_block(struct mblock* block) {
+    size_t prev_size = ((size_t*)block)[-1];
+    return (struct mblock*)((char*)block - prev_size - sizeof(struct mblock));
+}
+
+/// List predecessor of a free chunk.
+static struct mblock** prev_link(struct mblock* block) {
+    return (struct mblock**)block->memory;
+}
+
+/// Pushes a free chunk onto the free list of its size.
+static void insert_block(struct mblock* block) {
+    size_t i = list_index(block_size(block));
+    block->next = lists[i];
+    *prev_link(block) = NULL;
+    if (lists[i] != NULL) {
+        *prev_link(lists[i]) = block;
+    }
+    lists[i] = block;
+    fl_bitmap |= (uint64_t)1 << (i / SL_COUNT);
+    sl_bitmap[i / SL_COUNT] |= (uint32_t)1 << (i % SL_COUNT);
+}
+
+/// Removes a free chunk from its free list.
+static void unlink_block(struct mblock* block) {
+    struct mblock* prev = *prev_link(block);
+    if (prev != NULL) {
+        prev->next = block->next;
+    } else {
+        size_t i = list_index(block_size(block));
+        lists[i] = block->next;
+        // the list ran empty: clear its bit, and the first-level bit with the last one
+        if (lists[i] == NULL) {
+            sl_bitmap[i / SL_COUNT] &= ~((uint32_t)1 << (i % SL_COUNT));
+            if (sl_bitmap[i / SL_COUNT] == 0) {
+                fl_bitmap &= ~((uint64_t)1 << (i / SL_COUNT));
+            }
+        }
+    }
+    if (block->next != NULL) {
+        *prev_link(block->next) = prev;
+    }
+}
+
+/// Marks a chunk as occupied.
+static void mark_used(struct mblock* block) {
+    block->size &= ~FREE;
+    next_block(block)->size &= ~PREV_FREE;
+    block->next = MAGIC;
+}
+
+/// Merges a chunk that is no longer used with its free neighbours and files the result.
+static void release(struct mblock* block) {
+    size_t size = block_size(block);
+
+    // the header may end up inside a merged chunk: never leave MAGIC behind
+    block->next = NULL;
+
+    struct mblock* next = next_block(block);
+    if (next->size & FREE) {
+        unlink_block(next);
+        size += sizeof(struct mblock) + block_size(next);
+        count(&counters()->coalesces, 1);
+    }
+    if (block->size & PREV_FREE) {
+        block = prev_block(block);
+        unlink_block(block);
+        size += sizeof(struct mblock) + block_size(block);
+        count(&counters()->coalesces, 1);
+    }
+
+    block->size = size | FREE | (block->size & PREV_FREE);
+    ((size_t*)(block->memory + size))[-1] = size;
+    next_block(block)->size |= PREV_FREE;
+    insert_block(block);
+}
+
+/// Splits the tail off a used chunk if it is large enough to form a chunk of its own.
+static void split_block(struct mblock* block, size_t size) {
+    size_t old_size = block_size(block);
+    if (old_size >= size + sizeof(struct mblock) + MIN_PAYLOAD) {
+        block->size = size | (block->size & FLAGS);
+        struct mblock* rest = next_block(block);
+        rest->size = old_size - size - sizeof(struct mblock);
+        release(rest);
+        count(&counters()->splits, 1);
+    }
+}
+
+/// Maps a new arena with room for at least size bytes and files its memory as one free chunk.
+static int add_arena(size_t size) {
+    // find_block looks from the list of the rounded size on, the new chunk must land there
+    size_t needed = page_align(sizeof(struct arena) + 2 * sizeof(struct mblock) + request_size(size));
+    size_t length = arena_size > needed ? arena_size : needed;
+
+    struct arena* arena = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        return -1;
+    }
+    count_growth(length, size);
+    arena->size = length;
+    arena->next = arenas;
+    arenas = arena;
+    if (arena_size <= MAX_ARENA_SIZE / GROWTH_FACTOR) {
+        arena_size *= GROWTH_FACTOR;
+    }
+
+    // the fence at the end looks like an occupied chunk, so nothing merges past it
+    struct mblock* fence = (struct mblock*)((char*)arena + length - sizeof(struct mblock));
+    fence->next = MAGIC;
+    fence->size = 0;
+    struct mblock* first = (struct mblock*)arena->memory;
+    first->size = length - sizeof(struct arena) - 2 * sizeof(struct mblock);
+    release(first);
+    return 0;
+}
+
+/// Removes a free chunk of at least size bytes from the free lists, NULL if there is none.
+static struct mblock* find_block(size_t size) {
+    // every chunk of the list starting at the rounded size is large enough
+    size_t i = list_index(request_size(size));
+    size_t fl = i / SL_COUNT;
+    size_t steps = 1;
+
+    // a non-empty list of the same first level, else the first non-empty list of a larger one
+    uint32_t sl_map = sl_bitmap[fl] & (~(uint32_t)0 << (i % SL_COUNT));
+    if (sl_map == 0) {
+        steps++;
+        uint64_t fl_map = fl + 1 < FL_COUNT ? fl_bitmap & (~(uint64_t)0 << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            count_search(steps);
+            return NULL;
+        }
+        fl = __builtin_ctzll(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+
+    struct mblock* block = lists[fl * SL_COUNT + __builtin_ctz(sl_map)];
+    unlink_block(block);
+    count_search(steps);
+    return block;
+}
+
+/// Serves a request with a mapping of its own, its memory starting at a multiple of alignment.
+/// The header sits right in front of the memory, so for a large alignment it need not
+/// start the mapping; the unused whole pages at both ends are unmapped again.
+static void* map_block(size_t alignment, size_t size) {
+    size_t extra = alignment > ALIGNMENT ? alignment : 0;
+    size_t length = page_align(sizeof(struct mblock) + size + extra);
+    char* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    uintptr_t memory = ((uintptr_t)base + sizeof(struct mblock) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    struct mblock* block = (struct mblock*)(memory - sizeof(struct mblock));
+    char* start = mapping_start(block);
+    char* end = (char*)page_align(memory + size);
+    if (start != base) {
+        munmap(base, start - base);
+    }
+    if (end != base + length) {
+        munmap(end, base + length - end);
+    }
+
+    count_growth(end - start, size);
+    block->next = MAGIC;
+    block->size = ((uintptr_t)end - memory) | MMAPPED;
+    return block->memory;
+}
+
+/// Takes a free chunk of size bytes out of the arenas and marks it as occupied.
+/// The caller holds the lock.
+static struct mblock* take_block(size_t size) {
+    struct mblock* block = find_block(size);
+
+    // Map another arena if no chunk is large enough
+    if (block == NULL) {
+        if (add_arena(size) != 0) {
+            return NULL;
+        }
+        block = find_block(size);
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    // marking as "occupied" ( = MAGIC)
+    mark_used(block);
+    split_block(block, size);
+    return block;
+}
+
+/// Hands up to amount chunks of the calling thread's cache back to the free lists.
+static void drain_cache(size_t i, size_t amount) {
+    pthread_mutex_lock(&lock);
+    while (amount-- > 0 && cache[i].head != NULL) {
+        struct mblock* block = cache[i].head;
+        cache[i].head = block->next;
+        cache[i].count--;
+        release(block);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/// Destructor of cache_key: drains every cache of the exiting thread.
+static void drain_all(void* value) {
+    // the key is cleared before its destructor runs: a later free registers again
+    if (value != NULL) {
+        cache_registered = 0;
+    }
+    for (size_t i = 0; i < CACHED_CLASSES; i++) {
+        drain_cache(i, cache[i].count);
+    }
+}
+
+/// Creates cache_key.
+static void create_cache_key(void) {
+    pthread_key_create(&cache_key, drain_all);
+}
+
+/// Makes sure the calling thread's caches are drained when it exits.
+static void register_cache(void) {
+    if (!cache_registered) {
+        // a non-NULL value makes the destructor run when the thread exits
+        pthread_once(&cache_once, create_cache_key);
+        pthread_setspecific(cache_key, cache);
+        cache_registered = 1;
+    }
+}
+
+/// Fills the calling thread's cache of class i with one batch of chunks.
+static int refill_cache(size_t i) {
+    register_cache();
+
+    pthread_mutex_lock(&lock);
+    for (size_t n = 0; n < BATCH; n++) {
+        struct mblock* block = take_block(class_size(i));
+        if (block == NULL) {
+            break;
+        }
+        block->next = cache[i].head;
+        cache[i].head = block;
+        cache[i].count++;
+    }
+    pthread_mutex_unlock(&lock);
+
+    sample_peak(class_size(i));
+    return cache[i].head != NULL ? 0 : -1;
+}
+
+static void* allocate(size_t size);
+
+/// Serves a request whose memory must start at a multiple of alignment (a power of two).
+/// The front of an over-sized chunk is split off and freed again, so these chunks are freed
+/// like any other. Large requests get a mapping of their own like in allocate().
+static void* aligned_block(size_t alignment, size_t size) {
+    if (alignment <= ALIGNMENT) {
+        return allocate(size);
+    }
+    // zero bytes still get a chunk of their own, like in allocate()
+    if (size == 0) {
+        size = MIN_PAYLOAD;
+    }
+    if (size > PTRDIFF_MAX - alignment) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = align(size);
+    if (size >= MMAP_THRESHOLD) {
+        return map_block(alignment, size);
+    }
+
+    pthread_mutex_lock(&lock);
+    struct mblock* block = take_block(size + alignment + sizeof(struct mblock) + MIN_PAYLOAD);
+    if (block == NULL) {
+        pthread_mutex_unlock(&lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    uintptr_t start = (uintptr_t)block->memory;
+    uintptr_t aligned = (start + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (aligned != start) {
+        // the gap in front must be able to hold a free chunk of its own
+        if (aligned - start < sizeof(struct mblock) + MIN_PAYLOAD) {
+            aligned += alignment;
+        }
+        struct mblock* front = block;
+        block = (struct mblock*)(aligned - sizeof(struct mblock));
+        block->next = MAGIC;
+        block->size = start + block_size(front) - aligned;
+        front->size = (aligned - sizeof(struct mblock) - start) | (front->size & PREV_FREE);
+        release(front);
+    }
+    split_block(block, size);
+    pthread_mutex_unlock(&lock);
+
+    sample_peak(size);
+    return block->memory;
+}
+
+/// Holds the lock across fork(), so the child never sees half-updated free lists.
+static void fork_prepare(void) {
+    pthread_mutex_lock(&lock);
+}
+
+/// Releases the lock taken by fork_prepare in the parent and in the child.
+static void fork_done(void) {
+    pthread_mutex_unlock(&lock);
+}
+
+/// Sums up the free chunks of the arenas. The caller holds the lock.
+static void free_space(size_t* total, size_t* largest) {
+    *total = 0;
+    *largest = 0;
+    for (size_t i = 0; i < NUM_LISTS; i++) {
+        for (struct mblock* lauf = lists[i]; lauf; lauf = lauf->next) {
+            *total += block_size(lauf);
+            *largest = block_size(lauf) > *largest ? block_size(lauf) : *largest;
+        }
+    }
+}
+
+void halde_stats(struct halde_stats* stats) {
+    SUM(malloc_calls, stats->malloc_calls);
+    SUM(free_calls, stats->free_calls);
+    SUM(realloc_calls, stats->realloc_calls);
+    SUM(calloc_calls, stats->calloc_calls);
+    SUM(memalign_calls, stats->memalign_calls);
+    SUM(in_use, stats->in_use);
+    // the peak is sampled outside the caches, the current value may be higher
+    raise_peak(&peak_in_use, stats->in_use);
+    stats->peak_in_use = atomic_load_explicit(&peak_in_use, memory_order_relaxed);
+    stats->mapped = atomic_load_explicit(&mapped, memory_order_relaxed);
+    stats->peak_mapped = atomic_load_explicit(&peak_mapped, memory_order_relaxed);
+    SUM(cache_hits, stats->cache_hits);
+    for (size_t i = 0; i < HALDE_SEARCH_BUCKETS; i++) {
+        SUM(search[i], stats->search[i]);
+    }
+    SUM(splits, stats->splits);
+    SUM(coalesces, stats->coalesces);
+    SUM(realloc_in_place, stats->realloc_in_place);
+    SUM(realloc_copied, stats->realloc_copied);
+
+    pthread_mutex_lock(&lock);
+    free_space(&stats->free_bytes, &stats->largest_free);
+    pthread_mutex_unlock(&lock);
+}
+
+/// Writes the statistics to the saved stderr (HALDE_STATS).
+static void dump_stats(void) {
+    struct halde_stats stats;
+    halde_stats(&stats);
+
+    char buffer[1024];
+    size_t n = snprintf(buffer, sizeof(buffer),
+        "halde: malloc %zu, free %zu, realloc %zu, calloc %zu, memalign %zu\n"
+        "halde: in use %zu (peak %zu), mapped %zu (peak %zu), free %zu (largest %zu)\n"
+        "halde: cache hits %zu, splits %zu, coalesces %zu, realloc in place %zu, copied %zu bytes\n"
+        "halde: search lengths",
+        stats.malloc_calls, stats.free_calls, stats.realloc_calls, stats.calloc_calls, stats.memalign_calls,
+        stats.in_use, stats.peak_in_use, stats.mapped, stats.peak_mapped, stats.free_bytes, stats.largest_free,
+        stats.cache_hits, stats.splits, stats.coalesces, stats.realloc_in_place, stats.realloc_copied);
+    // snprintf returns the length it wanted, a cut line must not move n past the end
+    for (size_t i = 0; i < HALDE_SEARCH_BUCKETS && n < sizeof(buffer) - 1; i++) {
+        n += snprintf(buffer + n, sizeof(buffer) - n, " %s%zu: %zu", i == HALDE_SEARCH_BUCKETS - 1 ? ">=" : "", (size_t)1 << i, stats.search[i]);
+    }
+    n = n < sizeof(buffer) - 1 ? n : sizeof(buffer) - 2;
+    n += snprintf(buffer + n, sizeof(buffer) - n, "\n");
+    write(stats_fd, buffer, n);
+}
+
+/// Writes the events still in the ring buffer to the HALDE_TRACE file, oldest first.
+static void dump_trace(void) {
+    size_t end = atomic_load_explicit(&trace_next, memory_order_relaxed);
+    size_t start = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+
+    char buffer[4096];
+    size_t n = 0;
+    for (size_t i = start; i < end; i++) {
+        const struct event* event = &trace[i % TRACE_EVENTS];
+        n += snprintf(buffer + n, sizeof(buffer) - n, "%c %" PRIxPTR " %zu %" PRIxPTR "\n",
+            event->op, event->ptr, event->size, event->result);
+        if (n > sizeof(buffer) - 64) {
+            write(trace_fd, buffer, n);
+            n = 0;
+        }
+    }
+    write(trace_fd, buffer, n);
+    close(trace_fd);
+}
+
+/// Exit handler for HALDE_STATS and HALDE_TRACE.
+static void dump_at_exit(void) {
+    if (trace != NULL) {
+        dump_trace();
+    }
+    if (stats_fd != -1) {
+        dump_stats();
+    }
+}
+
+/// Registers the fork handlers and sets up HALDE_STATS and HALDE_TRACE before main() or,
+/// when preloaded, before the program starts.
+__attribute__((constructor)) static void initialize(void) {
+    pthread_atfork(fork_prepare, fork_done, fork_done);
+
+    const char* path = getenv("HALDE_TRACE");
+    if (path != NULL) {
+        trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (trace_fd != -1) {
+            trace = mmap(NULL, TRACE_EVENTS * sizeof(struct event), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (trace == MAP_FAILED) {
+                trace = NULL;
+            }
+        }
+    }
+    if (getenv("HALDE_STATS") != NULL) {
+        stats_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+    }
+    if (trace != NULL || stats_fd != -1) {
+        atexit(dump_at_exit);
+    }
+}
+
+/// Prints one free list in the format of the original single list.
+/// Offsets are relative to the start of the arena a chunk lies in.
+static void printBin(struct mblock* lauf) {
     const char fmt_init[] = "(off: %7zu, size:: %7zu)";
     const char fmt_next[] = " --> (off: %7zu, size:: %7zu)";
     const char* fmt = fmt_init;
     char buffer[sizeof(fmt_next) + 2 * 7];
 
     while (lauf) {
-        size_t n = snprintf(buffer, sizeof(buffer), fmt, (uintptr_t)lauf - (uintptr_t)memory, lauf->size);
+        struct arena* arena = arenas;
+        while ((char*)lauf < arena->memory || (char*)lauf >= (char*)arena + arena->size) {
+            arena = arena->next;
+        }
+        size_t n = snprintf(buffer, sizeof(buffer), fmt, (uintptr_t)lauf - (uintptr_t)arena->memory, block_size(lauf));
         if (n) {
             write(STDERR_FILENO, buffer, n);
         }
@@ -56,70 +767,108 @@ void printList(void) {
     write(STDERR_FILENO, "\n", 1);
 }
 
-void* malloc(size_t size) {
-    // Error handling for size
+/// Helper function to visualise the current state of the free-memory lists.
+/// The calling thread's cache is drained first, so its chunks show up as free.
+void printList(void) {
+    drain_all(NULL);
+    pthread_mutex_lock(&lock);
+
+    // Empty list
+    if (fl_bitmap == 0) {
+        char empty[] = "(empty)\n";
+        write(STDERR_FILENO, empty, sizeof(empty));
+        // no arena is mapped before the first request
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    // Print each non-empty list
+    char buffer[32];
+    for (size_t i = 0; i < NUM_LISTS; i++) {
+        if (lists[i] != NULL) {
+            size_t n = snprintf(buffer, sizeof(buffer), "[%7zu] ", class_size(i));
+            write(STDERR_FILENO, buffer, n);
+            printBin(lists[i]);
+        }
+    }
+
+    // Fragmentation: the share of free memory usable by a single request
+    size_t total;
+    size_t largest;
+    free_space(&total, &largest);
+    size_t n = snprintf(buffer, sizeof(buffer), "largest/free: %3zu%%\n", largest * 100 / total);
+    write(STDERR_FILENO, buffer, n);
+
+    // Arenas, oldest first, once the heap has grown
+    if (arenas->next != NULL) {
+        size_t count = 0;
+        for (struct arena* arena = arenas; arena; arena = arena->next) {
+            count++;
+        }
+        for (size_t a = 0; a < count; a++) {
+            struct arena* arena = arenas;
+            for (size_t skip = count - 1 - a; skip > 0; skip--) {
+                arena = arena->next;
+            }
+            n = snprintf(buffer, sizeof(buffer), "arena %zu: %zu\n", a, arena->size);
+            write(STDERR_FILENO, buffer, n);
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+/// malloc() without statistics and tracing.
+static void* allocate(size_t size) {
+    // zero bytes get the smallest chunk, so each call still returns a unique pointer
     if (size == 0) {
-        return NULL;
+        size = MIN_PAYLOAD;
     }
-    if (size > SIZE) {
+    // Error handling for size
+    if (size > PTRDIFF_MAX) {
         errno = ENOMEM;
         return NULL;
     }
+    if (size >= MMAP_THRESHOLD) {
+        return map_block(ALIGNMENT, size);
+    }
 
-    // Initialize memory on first malloc call
-    if (memory == NULL) {
-        memory = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (memory == MAP_FAILED) {
+    size = request_size(size);
+    size_t i = list_index(size);
+    struct mblock* current;
+
+    // small requests are served from the thread's own cache without locking
+    if (i < CACHED_CLASSES) {
+        if (cache[i].head == NULL && refill_cache(i) != 0) {
             errno = ENOMEM;
             return NULL;
         }
-        head = (struct mblock*)memory;
-        head->next = NULL;
-        head->size = SIZE - sizeof(struct mblock);
-    }
-
-    struct mblock* current = head;
-    struct mblock* previous = NULL; // previous element of in the list
-
-    // Loop goes through memory list
-    while (current != NULL) {
-        // if current->size is smaller than the requested size, it cannot fulfill the allocation
-        if (current->size >= size) {
-            // the current memory block is larger than the requested size
-            if (current->size > size + sizeof(struct mblock)) {
-                struct mblock* new_block = (struct mblock*)(current->memory + size);
-                // adjusting the sizes and linking the new block to the list
-                new_block->next = current->next;
-                new_block->size = current->size - size - sizeof(struct mblock); // see if statement
-                current->next = new_block;
-                current->size = size;
-            }
-            // if current block is the first element
-            if (previous == NULL) {
-                head = current->next;
-            }
-            else {
-                // skipping current block
-                // Removes the current block and updates the free-memory list correctly
-                previous->next = current->next;
-            }
-            // marking as "occupied" ( = MAGIC)
-            current->next = MAGIC;
-            return current->memory;
-        }
-        previous = current;
-        current = current->next;
+        current = cache[i].head;
+        cache[i].head = current->next;
+        cache[i].count--;
+        current->next = MAGIC;
+        count(&counters()->cache_hits, 1);
+        return current->memory;
     }
 
-    // Error handling if current == NULL
-    errno = ENOMEM;
-    return NULL;
+    pthread_mutex_lock(&lock);
+    current = take_block(size);
+    pthread_mutex_unlock(&lock);
+
+    // Error handling if no chunk is large enough
+    if (current == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    sample_peak(size);
+    return current->memory;
 }
 
-void free(void* ptr) {
+/// free() without statistics and tracing.
+static void deallocate(void* ptr) {
     // no memory block was allocated => there is nothing to free
     if (ptr == NULL) {
-        abort();
+        return;
     }
 
     // starting address of the memory
@@ -134,54 +883,388 @@ void free(void* ptr) {
         abort();
     }
 
-    // connecting the freed block to the previous first block in the list
-    block->next = head;
-    head = block;
+    // dedicated mappings go straight back to the system
+    if (block->size & MMAPPED) {
+        char* start = mapping_start(block);
+        size_t length = block->memory + block_size(block) - start;
+        uncount(&mapped, length);
+        munmap(start, length);
+        return;
+    }
+
+    // small chunks go into the thread's own cache, whichever thread allocated them
+    size_t i = list_index(block_size(block));
+    if (i < CACHED_CLASSES) {
+        // a thread that only frees never refills, it registers on its first push
+        register_cache();
+        block->next = cache[i].head;
+        cache[i].head = block;
+        if (++cache[i].count > CACHE_LIMIT) {
+            drain_cache(i, BATCH);
+        }
+        return;
+    }
+
+    // merging with free neighbours and connecting the result to the free list of its size
+    pthread_mutex_lock(&lock);
+    release(block);
+    pthread_mutex_unlock(&lock);
 }
 
-void* realloc(void* ptr, size_t size) {
+/// realloc() without statistics and tracing.
+static void* resize(void* ptr, size_t size) {
     // checks, if memory block was allocated
     if (ptr == NULL) {
-        return malloc(size);
+        return allocate(size);
     }
     // user wants to deallocate memory
     if (size == 0) {
-        free(ptr);
+        deallocate(ptr);
+        return NULL;
+    }
+
+    if (size > PTRDIFF_MAX) {
+        errno = ENOMEM;
         return NULL;
     }
 
     // address of the memory block head
     struct mblock* block = (struct mblock*)((char*)ptr - sizeof(struct mblock));
+    if (block->next != MAGIC) {
+        abort();
+    }
+    size_t old_size = block_size(block);
+
+    // dedicated mappings stay mappings, the kernel moves the pages if needed;
+    // the header keeps its offset into the first page
+    if ((block->size & MMAPPED) && size >= MMAP_THRESHOLD) {
+        char* start = mapping_start(block);
+        size_t offset = (char*)block - start;
+        size_t old_length = block->memory + old_size - start;
+        size_t length = page_align(offset + sizeof(struct mblock) + size);
+        start = mremap(start, old_length, length, MREMAP_MAYMOVE);
+        if (start == MAP_FAILED) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        uncount(&mapped, old_length);
+        count_growth(length, size);
+        block = (struct mblock*)(start + offset);
+        block->size = (length - offset - sizeof(struct mblock)) | MMAPPED;
+        return block->memory;
+    }
+
+    // a mapping shrunk below the threshold moves into an arena
+    if (!(block->size & MMAPPED)) {
+        size_t new_size = request_size(size);
+        int done = 0;
+        pthread_mutex_lock(&lock);
+
+        // shrinking: the tail becomes a free chunk of its own
+        if (new_size <= old_size) {
+            split_block(block, new_size);
+            done = 1;
+        }
+
+        // growing: absorb the following chunk if it is free and large enough
+        struct mblock* next = next_block(block);
+        if (!done && (next->size & FREE) && old_size + sizeof(struct mblock) + block_size(next) >= new_size) {
+            unlink_block(next);
+            block->size += sizeof(struct mblock) + block_size(next);
+            next_block(block)->size &= ~PREV_FREE;
+            split_block(block, new_size);
+            done = 1;
+        }
+
+        pthread_mutex_unlock(&lock);
+        if (done) {
+            count(&counters()->realloc_in_place, 1);
+            return ptr;
+        }
+    }
+
     // new memory block
-    void* new_ptr = malloc(size);
+    void* new_ptr = allocate(size);
     if (new_ptr == NULL) {
         return NULL;
     }
 
-    // if memory reallocation is successful
-    if (new_ptr) {
-        // copy the data from the old memory block to the new
-        memcpy(new_ptr, ptr, (size < block->size) ? size : block->size);
-        free(ptr);
+    // copy the data from the old memory block to the new
+    memcpy(new_ptr, ptr, (size < old_size) ? size : old_size);
+    count(&counters()->realloc_copied, (size < old_size) ? size : old_size);
+    deallocate(ptr);
+
+    return new_ptr;
+}
+
+/// Counts the chunk behind ptr as in use.
+static void count_in_use(void* ptr) {
+    if (ptr != NULL) {
+        count(&counters()->in_use, malloc_usable_size(ptr));
+    }
+}
+
+void* malloc(size_t size) {
+    count(&counters()->malloc_calls, 1);
+    void* ptr = allocate(size);
+    count_in_use(ptr);
+    trace_event('m', NULL, size, ptr);
+    return ptr;
+}
+
+void free(void* ptr) {
+    count(&counters()->free_calls, 1);
+    if (ptr != NULL) {
+        uncount(&counters()->in_use, malloc_usable_size(ptr));
     }
+    trace_event('f', ptr, 0, NULL);
+    deallocate(ptr);
+}
+
+void* realloc(void* ptr, size_t size) {
+    count(&counters()->realloc_calls, 1);
+    size_t old_size = malloc_usable_size(ptr);
+    void* new_ptr = resize(ptr, size);
 
+    // a failed realloc leaves the old chunk alone
+    if (new_ptr != NULL || size == 0) {
+        uncount(&counters()->in_use, old_size);
+        count_in_use(new_ptr);
+    }
+    trace_event('r', ptr, size, new_ptr);
     return new_ptr;
 }
 
 // allocates memory for an array of elements and initializes all bytes in the allocated memory to zero
 void* calloc(size_t nmemb, size_t size) {
+    count(&counters()->calloc_calls, 1);
 
-    if (nmemb == 0 || size == 0) {
+    // nmemb * size must not overflow
+    if (nmemb != 0 && size > SIZE_MAX / nmemb) {
+        errno = ENOMEM;
         return NULL;
     }
     // total_size of memory block to be allocated
     size_t total_size = nmemb * size;
-    void* ptr = malloc(total_size);
+    void* ptr = allocate(total_size);
+    count_in_use(ptr);
+    trace_event('c', NULL, total_size, ptr);
 
-    // if memory allocation is successful
-    if (ptr) {
+    // if memory allocation is successful; fresh mappings are already zeroed
+    if (ptr && total_size < MMAP_THRESHOLD) {
         memset(ptr, 0, total_size);
     }
 
     return ptr;
 }
+
+void* memalign(size_t alignment, size_t size) {
+    count(&counters()->memalign_calls, 1);
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    void* ptr = aligned_block(alignment, size);
+    count_in_use(ptr);
+    trace_event('a', (void*)alignment, size, ptr);
+    return ptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    // errno must stay untouched
+    int saved = errno;
+    count(&counters()->memalign_calls, 1);
+    void* ptr = aligned_block(alignment, size);
+    count_in_use(ptr);
+    trace_event('a', (void*)alignment, size, ptr);
+    if (ptr == NULL) {
+        errno = saved;
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void* valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size) {
+    if (size > PTRDIFF_MAX) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(sysconf(_SC_PAGESIZE), page_align(size));
+}
+
+size_t malloc_usable_size(void* ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    struct mblock* block = (struct mblock*)((char*)ptr - sizeof(struct mblock));
+    return block_size(block);
+}
+
+/// Minimum number of objects in a slab; larger objects get slabs of several pages.
+#define SLAB_OBJECTS 8
+
+/// Slab of a pool: slab_size bytes aligned to slab_size, this header first, then the objects.
+/// Objects have no header of their own, their slab is found by masking their address.
+/// Freed objects are linked through their first word.
+struct slab {
+    struct halde_pool* pool;
+    struct slab* next;
+    struct slab* prev;
+    void* free;
+    char* unused;
+    size_t used;
+};
+
+/// Pool of objects of one size.
+struct halde_pool {
+    size_t size;
+    size_t slab_size;
+    size_t per_slab;
+    struct slab* partial;
+    struct slab* full;
+    pthread_mutex_t lock;
+};
+
+/// Pushes a slab onto one of the slab lists of its pool.
+static void slab_push(struct slab** list, struct slab* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+/// Removes a slab from one of the slab lists of its pool.
+static void slab_remove(struct slab** list, struct slab* slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+struct halde_pool* halde_pool_create(size_t size) {
+    if (size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (size > MMAP_THRESHOLD / SLAB_OBJECTS) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct halde_pool* pool = allocate(sizeof(struct halde_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->size = align(size);
+    pool->slab_size = sysconf(_SC_PAGESIZE);
+    while ((pool->slab_size - align(sizeof(struct slab))) / pool->size < SLAB_OBJECTS) {
+        pool->slab_size *= 2;
+    }
+    pool->per_slab = (pool->slab_size - align(sizeof(struct slab))) / pool->size;
+    pool->partial = NULL;
+    pool->full = NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void* halde_pool_alloc(struct halde_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+
+    // all slabs are full: take a new one from the arenas
+    struct slab* slab = pool->partial;
+    if (slab == NULL) {
+        slab = aligned_block(pool->slab_size, pool->slab_size);
+        if (slab == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        count_in_use(slab);
+        slab->pool = pool;
+        slab->free = NULL;
+        slab->unused = (char*)slab + align(sizeof(struct slab));
+        slab->used = 0;
+        slab_push(&pool->partial, slab);
+    }
+
+    void* ptr = slab->free;
+    if (ptr != NULL) {
+        slab->free = *(void**)ptr;
+    } else {
+        ptr = slab->unused;
+        slab->unused += pool->size;
+    }
+    if (++slab->used == pool->per_slab) {
+        slab_remove(&pool->partial, slab);
+        slab_push(&pool->full, slab);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return ptr;
+}
+
+void halde_pool_free(struct halde_pool* pool, void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    // objects of other pools or of malloc() do not belong here
+    struct slab* slab = (struct slab*)((uintptr_t)ptr & ~(uintptr_t)(pool->slab_size - 1));
+    if (slab->pool != pool) {
+        abort();
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    *(void**)ptr = slab->free;
+    slab->free = ptr;
+    if (slab->used-- == pool->per_slab) {
+        slab_remove(&pool->full, slab);
+        slab_push(&pool->partial, slab);
+    }
+
+    // empty slabs go back to the arenas, except for the last one with room
+    if (slab->used == 0 && (pool->partial != slab || slab->next != NULL)) {
+        slab_remove(&pool->partial, slab);
+        slab->pool = NULL;
+        uncount(&counters()->in_use, malloc_usable_size(slab));
+        deallocate(slab);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void halde_pool_destroy(struct halde_pool* pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        struct slab* slab = i == 0 ? pool->partial : pool->full;
+        while (slab != NULL) {
+            struct slab* next = slab->next;
+            slab->pool = NULL;
+            uncount(&counters()->in_use, malloc_usable_size(slab));
+            deallocate(slab);
+            slab = next;
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    deallocate(pool);
+}
@@ -5,7 +5,8 @@
 
 /*
    malloc() allocates size bytes and returns a pointer to the
-   allocated memory. The memory is not cleared.
+   allocated memory. The memory is not cleared. If size is 0,
+   a unique pointer that can be passed to free() is returned.
 
    RETURN VALUE: The value returned is a pointer
    to the allocated memory or NULL if the request fails. The
@@ -50,6 +51,136 @@ void *realloc(void *ptr, size_t size);
 */
 void *calloc(size_t nmemb, size_t size);
 
+/*
+   memalign() allocates size bytes like malloc() and returns
+   a pointer to the allocated memory. The memory address will
+   be a multiple of alignment, which must be a power of two.
+   aligned_alloc() does the same.
+
+   RETURN VALUE: The value returned is a pointer
+   to the allocated memory or NULL if the request fails. The
+   errno will be set to indicate the error.
+*/
+void *memalign(size_t alignment, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
+
+/*
+   posix_memalign() allocates size bytes like memalign() and
+   stores the address of the allocated memory in *memptr. The
+   alignment must be a power of two multiple of sizeof(void *).
+
+   RETURN VALUE: 0 on success, EINVAL for an invalid alignment
+   or ENOMEM if the request fails. The errno is not changed.
+*/
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/*
+   valloc() allocates size bytes aligned to the page size.
+   pvalloc() does the same but rounds size up to whole pages.
+
+   RETURN VALUE: The value returned is a pointer
+   to the allocated memory or NULL if the request fails. The
+   errno will be set to indicate the error.
+*/
+void *valloc(size_t size);
+void *pvalloc(size_t size);
+
+/*
+   malloc_usable_size() returns the number of bytes usable in
+   the block pointed to by ptr, which must have been returned
+   by one of the functions above.
+
+   RETURN VALUE: the usable size or 0 if ptr is NULL
+*/
+size_t malloc_usable_size(void *ptr);
+
+/// Number of buckets of the free-list search histogram.
+#define HALDE_SEARCH_BUCKETS 8
+
+/// Allocator statistics, see halde_stats().
+struct halde_stats {
+    size_t malloc_calls;
+    size_t free_calls;
+    size_t realloc_calls;
+    size_t calloc_calls;
+    size_t memalign_calls;      // memalign, aligned_alloc, posix_memalign, valloc, pvalloc
+    size_t in_use;              // usable bytes currently handed out
+    size_t peak_in_use;         // sampled outside the thread caches and on each call
+    size_t mapped;              // bytes currently mapped from the system
+    size_t peak_mapped;
+    size_t free_bytes;          // free chunks in the arenas, without the thread caches
+    size_t largest_free;
+    size_t cache_hits;          // requests served from a thread cache
+    size_t search[HALDE_SEARCH_BUCKETS]; // search[i]: free-list searches of 2^i to 2^(i+1)-1 steps
+    size_t splits;
+    size_t coalesces;
+    size_t realloc_in_place;
+    size_t realloc_copied;      // bytes copied by realloc
+};
+
+/*
+   halde_stats() fills *stats with the counters of the allocator.
+   The counters are always on and updated without locking, so
+   values taken while other threads allocate may be slightly off.
+
+   Setting HALDE_STATS in the environment prints the statistics
+   to stderr at exit. Setting HALDE_TRACE=<file> keeps the last
+   65536 allocation events in a ring buffer and writes them to
+   <file> at exit, one per line as "<op> <ptr> <size> <result>"
+   with ptr and result in hex:
+
+     m 0 <size> <result>          malloc
+     c 0 <total> <result>         calloc
+     a <alignment> <size> <result>  memalign and friends
+     r <ptr> <size> <result>      realloc
+     f <ptr> 0 0                  free
+
+   RETURN VALUE: no value
+*/
+void halde_stats(struct halde_stats *stats);
+
+/// Pool of fixed-size objects, see halde_pool_create().
+struct halde_pool;
+
+/*
+   halde_pool_create() creates a pool for objects of size bytes.
+   Objects are packed into page-sized slabs without a header of
+   their own, so allocating and freeing them takes constant time
+   and they lie densely in memory. Pools are thread-safe.
+
+   RETURN VALUE: The value returned is a pointer
+   to the pool or NULL if the request fails. The
+   errno will be set to indicate the error.
+*/
+struct halde_pool *halde_pool_create(size_t size);
+
+/*
+   halde_pool_alloc() allocates one object of the pool. The
+   memory is not cleared.
+
+   RETURN VALUE: The value returned is a pointer
+   to the object or NULL if the request fails. The
+   errno will be set to indicate the error.
+*/
+void *halde_pool_alloc(struct halde_pool *pool);
+
+/*
+   halde_pool_free() frees an object returned by halde_pool_alloc()
+   of the same pool. If ptr belongs to no slab of the pool, the
+   program is aborted. If ptr is NULL, no operation is performed.
+
+   RETURN VALUE: no value
+*/
+void halde_pool_free(struct halde_pool *pool, void *ptr);
+
+/*
+   halde_pool_destroy() frees the pool and all objects still
+   allocated from it.
+
+   RETURN VALUE: no value
+*/
+void halde_pool_destroy(struct halde_pool *pool);
+
 /*
  * printList is a non-standard function which prints the internal state of the
  * free list.
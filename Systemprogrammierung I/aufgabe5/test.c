@@ -1,10 +1,145 @@
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "halde.h"
 
+// halde-ref.o has neither statistics nor memalign and pools: test-ref skips those checks
+#pragma weak halde_stats
+#pragma weak halde_pool_create
+#pragma weak halde_pool_alloc
+#pragma weak halde_pool_free
+#pragma weak halde_pool_destroy
+
+// Messages go to the unbuffered stderr, so printing never allocates between two checks
+static void check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        abort();
+    }
+}
+
+static size_t coalesces(void) {
+    struct halde_stats stats;
+    halde_stats(&stats);
+    return stats.coalesces;
+}
+
+static size_t realloc_in_place(void) {
+    struct halde_stats stats;
+    halde_stats(&stats);
+    return stats.realloc_in_place;
+}
+
+// Chunks above the thread caches come straight from the free lists, so neighbours are merged on free
+static void test_merge(void) {
+    char *a = malloc(5000);
+    char *b = malloc(5000);
+    char *c = malloc(5000);
+    check(a && b && c, "malloc(5000)");
+    check(a + 5000 <= b && b + 5000 <= c, "chunks taken from the front of the free chunk");
+
+    size_t before = coalesces();
+    free(a);
+    free(b);
+    check(coalesces() > before, "free merges with the free chunk in front");
+
+    // a and b form one chunk again, large enough for both
+    char *d = malloc(9000);
+    check(d == a, "merged neighbours serve a larger request");
+    free(c);
+    free(d);
+}
+
+static void test_realloc(void) {
+    char *p = malloc(20000);
+    check(p != NULL, "malloc(20000)");
+    memset(p, 'x', 20000);
+
+    uintptr_t address = (uintptr_t)p;
+    size_t before = realloc_in_place();
+    p = realloc(p, 10000);
+    check((uintptr_t)p == address, "realloc shrinks in place");
+
+    // the cut-off tail is free again, so growing takes it back
+    char *q = realloc(p, 30000);
+    check((uintptr_t)q == address, "realloc grows into the free chunk behind");
+    check(realloc_in_place() == before + 2, "in-place reallocs are counted");
+    for (size_t i = 0; i < 10000; i++) {
+        check(q[i] == 'x', "realloc keeps the contents");
+    }
+    free(q);
+}
+
+static void test_memalign(void) {
+    // the last sizes exceed the first arena (SIZE) and the mmap threshold
+    static const size_t sizes[] = {1, 100, 5000, 100000, 300000, 3000000, 20000000};
+    for (size_t alignment = 32; alignment <= 65536; alignment *= 2) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            char *p = memalign(alignment, sizes[i]);
+            check(p != NULL, "memalign");
+            check((uintptr_t)p % alignment == 0, "memalign alignment");
+            check(malloc_usable_size(p) >= sizes[i], "memalign size");
+            memset(p, 1, sizes[i]);
+            free(p);
+        }
+    }
+
+    void *p = NULL;
+    check(posix_memalign(&p, 4096, 1000) == 0 && (uintptr_t)p % 4096 == 0, "posix_memalign");
+    free(p);
+    check(posix_memalign(&p, 0, 1000) == EINVAL, "posix_memalign alignment 0");
+    check(posix_memalign(&p, 24, 1000) == EINVAL, "posix_memalign alignment not a power of two");
+}
+
+static void test_pool(void) {
+    enum { OBJECTS = 1000, SIZE = 48 };
+    static char *objects[OBJECTS];
+
+    struct halde_pool *pool = halde_pool_create(SIZE);
+    check(pool != NULL, "halde_pool_create");
+    for (size_t i = 0; i < OBJECTS; i++) {
+        objects[i] = halde_pool_alloc(pool);
+        check(objects[i] != NULL, "halde_pool_alloc");
+        memset(objects[i], (int)(i % 256), SIZE);
+    }
+    // objects must not overlap: each still holds its own pattern
+    for (size_t i = 0; i < OBJECTS; i++) {
+        check(objects[i][0] == (char)(i % 256) && objects[i][SIZE - 1] == (char)(i % 256), "pool objects are separate");
+    }
+
+    // freed objects are handed out again
+    for (size_t i = 0; i < OBJECTS; i += 2) {
+        halde_pool_free(pool, objects[i]);
+    }
+    for (size_t i = 0; i < OBJECTS; i += 2) {
+        objects[i] = halde_pool_alloc(pool);
+        check(objects[i] != NULL, "halde_pool_alloc after free");
+    }
+    halde_pool_free(pool, NULL);
+
+    // destroy also frees the objects still allocated
+    halde_pool_destroy(pool);
+}
+
+static void test_zero(void) {
+    char *a = malloc(0);
+    char *b = malloc(0);
+    check(a != NULL && b != NULL && a != b, "malloc(0) returns unique pointers");
+    char *c = calloc(0, 16);
+    check(c != NULL, "calloc(0, n)");
+    char *d = realloc(NULL, 0);
+    check(d != NULL, "realloc(NULL, 0)");
+    free(a);
+    free(b);
+    free(c);
+    free(d);
+}
+
 int main(int argc, char *argv[]) {
     printList();
 
@@ -46,5 +181,15 @@ int main(int argc, char *argv[]) {
     free(m4);
     printList();
 
-    abort();
+    // Behaviour checks of halde.c
+    if (halde_stats) {
+        test_merge();
+        test_realloc();
+        test_memalign();
+        test_pool();
+        test_zero();
+        fprintf(stderr, "all checks passed\n");
+    }
+
+    exit(EXIT_SUCCESS);
 }